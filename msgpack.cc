@@ -20,32 +20,101 @@
  * */
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 using std::string;
 using std::vector;
 
 #include <msgpack.h>
+#include "msgpack_core.h"
 #include "mex.h"
 #include "matrix.h"
+#include "msgpack_ring.h"
+
+// EXT type codes used by this binding for MATLAB-specific data
+enum MatlabExtCode {
+  EXT_COMPLEX = 0x43,       // 'C': 1-byte mxClassID followed by interleaved real/imag data
+  EXT_DATETIME = 0x44,      // 'D': float64 POSIX seconds, NaN for NaT
+  EXT_STRING_ARRAY = 0x53,  // 'S': string block (see pack_string_block)
+  EXT_TABLE_SHAPE = 0x56,   // 'V': uint64 size of each dimension of a table variable
+  EXT_CATEGORICAL = 0x63    // 'c': 1-byte code width, string block of categories, codes (0 = undefined)
+};
+
+// How each ext code is packed and unpacked (see register_ext), indexed by the code as uint8_t.
+ExtCodec ext_codecs[256];
 
-enum NilUnpack {UNPACK_NIL_ZERO, UNPACK_NIL_NAN, UNPACK_NIL_EMPTY, UNPACK_NIL_CELL};
+void reset_ext_codecs() {
+  for (size_t i = 0; i < 256; i++) {
+    ExtCodec codec = {EXT_KIND_NONE, NUM_UINT8, 1};
+    ext_codecs[i] = codec;
+  }
+  ext_codecs[EXT_COMPLEX].kind = EXT_KIND_COMPLEX;
+  ext_codecs[EXT_DATETIME].kind = EXT_KIND_DATETIME;
+  ext_codecs[EXT_STRING_ARRAY].kind = EXT_KIND_STRING_ARRAY;
+  ext_codecs[EXT_CATEGORICAL].kind = EXT_KIND_CATEGORICAL;
+}
 
-static struct mp_flags {
-  bool unicode_strs = true;
-  bool pack_u8_bin = false;
-  bool unpack_map_as_cells = false;
-  bool unpack_narrow = false;
-  bool unpack_ext_w_tag = false;
-  bool pack_other_as_nil = true;
-  NilUnpack unpack_nil = UNPACK_NIL_ZERO;
-  bool unpack_nil_array_skip = true;
-} flags;
+// mxClassID of each NumClass
+static const mxClassID num_classids[] = {mxLOGICAL_CLASS, mxDOUBLE_CLASS, mxSINGLE_CLASS,
+                                         mxINT8_CLASS, mxUINT8_CLASS, mxINT16_CLASS,
+                                         mxUINT16_CLASS, mxINT32_CLASS, mxUINT32_CLASS,
+                                         mxINT64_CLASS, mxUINT64_CLASS};
+
+static mp_flags flags;
+static mp_limits limits;
+
+struct limit_entry {
+  const char* name;
+  size_t* val;
+};
+limit_entry LimitMap[] = {
+  {"max_depth", &limits.max_depth},
+  {"max_bytes", &limits.max_bytes},
+  {"max_container_len", &limits.max_container_len},
+  {"max_str_len", &limits.max_str_len},
+  {"max_chunk_len", &limits.max_chunk_len},
+};
+
+// Handle a "<name>=<value>" flag. Returns false if the name isn't a limit.
+bool set_limit(const string& flag) {
+  size_t eq = flag.find('=');
+  if (eq == string::npos) return false;
+  string name = flag.substr(0, eq);
+  for (size_t i = 0; i < sizeof(LimitMap) / sizeof(LimitMap[0]); i++) {
+    if (name == LimitMap[i].name) {
+      string val = flag.substr(eq + 1);
+      if (val == "Inf" || val == "inf") {
+        *LimitMap[i].val = SIZE_MAX;
+        return true;
+      }
+      char* end = NULL;
+      unsigned long long parsed = strtoull(val.c_str(), &end, 10);
+      if (val.empty() || *end != '\0')
+        mexErrMsgIdAndTxt("msgpack:invalid_flag", "%s needs a non-negative integer value.",
+                          name.c_str());
+      *LimitMap[i].val = parsed;
+      return true;
+    }
+  }
+  return false;
+}
 
 void print_flags() {
   mexPrintf("%cunicode_strs\n", (flags.unicode_strs) ? '+' : '-');
@@ -55,6 +124,8 @@ void print_flags() {
   mexPrintf("%cunpack_ext_w_tag\n", (flags.unpack_ext_w_tag) ? '+' : '-');
   mexPrintf("%cpack_other_as_nil\n", (flags.pack_other_as_nil) ? '+' : '-');
   mexPrintf("%cunpack_nil_array_skip\n", (flags.unpack_nil_array_skip) ? '+' : '-');
+  mexPrintf("%cunpack_records\n", (flags.unpack_records) ? '+' : '-');
+  mexPrintf("%cunpack_str_array_as_string\n", (flags.unpack_str_array_as_string) ? '+' : '-');
   mexPrintf("+unpack_nil_");
   switch (flags.unpack_nil) {
     case UNPACK_NIL_ZERO:
@@ -70,19 +141,23 @@ void print_flags() {
       mexPrintf("cell\n");
       break;
   }
+  for (size_t i = 0; i < sizeof(LimitMap) / sizeof(LimitMap[0]); i++) {
+    if (*LimitMap[i].val == SIZE_MAX) mexPrintf("%s=Inf\n", LimitMap[i].name);
+    else mexPrintf("%s=%zu\n", LimitMap[i].name, *LimitMap[i].val);
+  }
 }
 
-mxArray* mex_unpack_boolean(const msgpack_object& obj);
-mxArray* mex_unpack_positive_integer(const msgpack_object& obj);
-mxArray* mex_unpack_negative_integer(const msgpack_object& obj);
-mxArray* mex_unpack_float(const msgpack_object& obj);
-mxArray* mex_unpack_double(const msgpack_object& obj);
-mxArray* mex_unpack_str(const msgpack_object& obj);
-mxArray* mex_unpack_nil(const msgpack_object& obj);
-mxArray* mex_unpack_map(const msgpack_object& obj);
-mxArray* mex_unpack_array(const msgpack_object& obj);
-mxArray* mex_unpack_bin(const msgpack_object& obj);
-mxArray* mex_unpack_ext(const msgpack_object& obj);
+mxArray* mex_unpack_complex(const ExtPayload& ext);
+mxArray* mex_unpack_string_array(const ExtPayload& ext);
+mxArray* mex_unpack_categorical(const ExtPayload& ext);
+mxArray* mex_unpack_datetime(const ExtPayload& ext);
+void pack_node(msgpack_packer *pk, int nrhs, const mxArray* prhs);
+void mex_pack_complex(msgpack_packer *pk, int nrhs, const mxArray *prhs);
+void mex_pack_string(msgpack_packer *pk, int nrhs, const mxArray *prhs);
+void mex_pack_categorical(msgpack_packer *pk, int nrhs, const mxArray *prhs);
+void mex_pack_datetime(msgpack_packer *pk, int nrhs, const mxArray *prhs);
+void mex_pack_table(msgpack_packer *pk, int nrhs, const mxArray *prhs);
+void pack_table_variable(msgpack_packer *pk, int nrhs, const mxArray* var);
 
 typedef struct mxArrayRes mxArrayRes;
 struct mxArrayRes {
@@ -90,474 +165,410 @@ struct mxArrayRes {
   mxArrayRes * next;
 };
 
-// Create pack and unpack function mappings
+// Create pack function mappings
 typedef void (*pack_fn)(msgpack_packer* pk, int nrhs, const mxArray* prhs);
 pack_fn PackMap[16] = {NULL};
-typedef mxArray* (*unpack_fn)(const msgpack_object& obj);
-unpack_fn unPackMap[11] = {NULL};
+// MATLAB classes without an mxClassID of their own, packed by class name.
+struct object_pack_entry {
+  const char* classname;
+  pack_fn fn;
+};
+object_pack_entry ObjectPackMap[] = {
+  {"string", mex_pack_string},
+  {"categorical", mex_pack_categorical},
+  {"datetime", mex_pack_datetime},
+  {"table", mex_pack_table},
+};
 
 // pack and unpack wrapper functions
 void pack_mxArray(msgpack_packer *pk, int nrhs, const mxArray* prhs);
 mxArray* unpack_obj(const msgpack_object& obj);
+void writer_close_all(void);
+
+// Explicit work stack for packing, so that deeply nested data doesn't recurse on the C stack. A
+// frame holds a cell, struct or table being packed and the position of the next element to pack.
+enum PackFrameKind {PACK_FRAME_CELL, PACK_FRAME_STRUCT, PACK_FRAME_TABLE};
+
+struct PackFrame {
+  PackFrameKind kind;
+  const mxArray* arr;
+  mxArray* owned;  // Temporary to destroy when done, or NULL
+  size_t i, n;
+  size_t depth;
+  size_t chunk_len;  // Elements per piece of a chunked cell array (see EXT_CHUNKED), or 0
+};
+
+vector<PackFrame> pack_stack;
+size_t pack_depth = 0;
+
+void push_pack_frame(PackFrameKind kind, const mxArray* arr, mxArray* owned, size_t n,
+                     size_t chunk_len = 0) {
+  if (n == 0) {
+    if (owned) mxDestroyArray(owned);
+    return;
+  }
+  if (pack_depth >= limits.max_depth)
+    mexErrMsgIdAndTxt("msgpack:max_depth", "Nesting deeper than max_depth=%zu.", limits.max_depth);
+  PackFrame frame = {kind, arr, owned, 0, n, pack_depth + 1, chunk_len};
+  pack_stack.push_back(frame);
+}
+
+void ring_close_all();
+void ring_release_unpacking();
 
 void mexExit(void) {
+  writer_close_all();
+  ring_close_all();
   fprintf(stdout, "Existing Mex Msgpack \n");
   fflush(stdout);
 }
 
-mxArray* unpack_obj(const msgpack_object& obj) {
-  mxArray* ret = NULL;
-  if (obj.type >= 0 && obj.type <= 0x0a) {
-    ret = (*unPackMap[obj.type])(obj);
-  } else {
-    mexErrMsgIdAndTxt("msgpack:unpack_bad_object_type",
-                      "Don't know how to unpack object type %d.", obj.type);
+// Size in bytes of one element of a real numeric class, or 0 if not numeric.
+size_t numeric_class_size(unsigned int classid) {
+  switch (classid) {
+    case mxDOUBLE_CLASS: case mxINT64_CLASS: case mxUINT64_CLASS:
+      return 8;
+    case mxSINGLE_CLASS: case mxINT32_CLASS: case mxUINT32_CLASS:
+      return 4;
+    case mxINT16_CLASS: case mxUINT16_CLASS:
+      return 2;
+    case mxINT8_CLASS: case mxUINT8_CLASS:
+      return 1;
+    default:
+      return 0;
   }
-  return ret;
 }
 
-mxArray* mex_unpack_boolean(const msgpack_object& obj) {
-  return mxCreateLogicalScalar(obj.via.boolean);
-}
-
-mxArray* mex_unpack_positive_integer(const msgpack_object& obj) {
-  if (flags.unpack_narrow) {
-    mxArray *ret = NULL;
-    if ((uint8_t)obj.via.u64 == obj.via.u64) {
-      // 8-bit
-      ret = mxCreateNumericMatrix(1, 1, mxUINT8_CLASS, mxREAL);
-      uint8_t *ptr = (uint8_t *)mxGetData(ret);
-      *ptr = obj.via.u64;
-    } else if ((uint16_t)obj.via.u64 == obj.via.u64) {
-      // 16-bit
-      ret = mxCreateNumericMatrix(1, 1, mxUINT16_CLASS, mxREAL);
-      uint16_t *ptr = (uint16_t *)mxGetData(ret);
-      *ptr = obj.via.u64;
-    } else if ((uint32_t)obj.via.u64 == obj.via.u64) {
-      // 32-bit
-      ret = mxCreateNumericMatrix(1, 1, mxUINT32_CLASS, mxREAL);
-      uint32_t *ptr = (uint32_t *)mxGetData(ret);
-      *ptr = obj.via.u64;
-    } else {
-      // 64-bit
-      ret = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
-      uint64_t *ptr = (uint64_t *)mxGetData(ret);
-      *ptr = obj.via.u64;
+// Append the UTF-8 encoding of n UTF-16 code units to out. Unpaired surrogates become U+FFFD.
+void utf16_to_utf8(const mxChar* src, size_t n, string& out) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t c = src[i];
+    if (c >= 0xD800 && c < 0xE000) {
+      if (c < 0xDC00 && i + 1 < n && src[i + 1] >= 0xDC00 && src[i + 1] < 0xE000)
+        c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+      else
+        c = 0xFFFD;
     }
-    return ret;
-  } else
-    return mxCreateDoubleScalar((double)obj.via.u64);
-}
-
-mxArray* mex_unpack_negative_integer(const msgpack_object& obj) {
-  if (flags.unpack_narrow) {
-    mxArray *ret = NULL;
-    if ((int8_t)obj.via.i64 == obj.via.i64) {
-      // 8-bit
-      ret = mxCreateNumericMatrix(1, 1, mxINT8_CLASS, mxREAL);
-      int8_t *ptr = (int8_t *)mxGetData(ret);
-      *ptr = obj.via.i64;
-    } else if ((int16_t)obj.via.i64 == obj.via.i64) {
-      // 16-bit
-      ret = mxCreateNumericMatrix(1, 1, mxINT16_CLASS, mxREAL);
-      int16_t *ptr = (int16_t *)mxGetData(ret);
-      *ptr = obj.via.i64;
-    } else if ((int32_t)obj.via.i64 == obj.via.i64) {
-      // 32-bit
-      ret = mxCreateNumericMatrix(1, 1, mxINT32_CLASS, mxREAL);
-      int32_t *ptr = (int32_t *)mxGetData(ret);
-      *ptr = obj.via.i64;
+    if (c < 0x80) {
+      out += (char)c;
+    } else if (c < 0x800) {
+      out += (char)(0xC0 | (c >> 6));
+      out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      out += (char)(0xE0 | (c >> 12));
+      out += (char)(0x80 | ((c >> 6) & 0x3F));
+      out += (char)(0x80 | (c & 0x3F));
     } else {
-      // 64-bit
-      ret = mxCreateNumericMatrix(1, 1, mxINT64_CLASS, mxREAL);
-      int64_t *ptr = (int64_t *)mxGetData(ret);
-      *ptr = obj.via.i64;
+      out += (char)(0xF0 | (c >> 18));
+      out += (char)(0x80 | ((c >> 12) & 0x3F));
+      out += (char)(0x80 | ((c >> 6) & 0x3F));
+      out += (char)(0x80 | (c & 0x3F));
     }
-    return ret;
-  } else
-    return mxCreateDoubleScalar((double)obj.via.i64);
+  }
 }
 
-mxArray* mex_unpack_float(const msgpack_object& obj) {
-  if (flags.unpack_narrow) {
-    mxArray* ret = mxCreateNumericMatrix(1, 2, mxSINGLE_CLASS, mxREAL);
-    float* ptr = (float *)mxGetData(ret);
-    *ptr = (float)obj.via.f64;
-    return ret;
-  } else
-    return mxCreateDoubleScalar(obj.via.f64);
+// Create a 1xN char array from UTF-8 bytes (0x0 if empty).
+mxArray* mxCreateCharFromUTF8(const char* ptr, size_t n) {
+  mwSize dims[2] = {n ? 1u : 0u, n};
+  mxArray* ret = mxCreateCharArray(2, dims);
+  if (n) {
+    size_t len = utf8_to_utf16(ptr, n, (uint16_t*)mxGetData(ret));
+    if (len < n) mxSetN(ret, len);  // Shrinks in place, no reallocation.
+  }
+  return ret;
 }
 
-mxArray* mex_unpack_double(const msgpack_object& obj) {
-  return mxCreateDoubleScalar(obj.via.f64);
-}
+// Builds mxArrays for the converter core (see msgpack_core.h).
+struct MexBuilder {
+  typedef mxArray* Value;
 
-mxArray* mex_unpack_str(const msgpack_object& obj) {
-  mxArray *ret;
-  if (obj.via.str.size == 0) {
-    mwSize dims[2] = {0, 0};
-    ret = mxCreateCharArray(2, dims);
+  mxArray* create_numeric(NumClass cls, size_t n, void** data) {
+    mxArray* ret = (cls == NUM_LOGICAL) ? mxCreateLogicalMatrix(1, n)
+                                        : mxCreateNumericMatrix(1, n, num_classids[cls], mxREAL);
+    *data = mxGetData(ret);
     return ret;
   }
-  mxArray* data = mxCreateNumericMatrix(1, obj.via.str.size, mxUINT8_CLASS, mxREAL);
-  uint8_t *ptr = (uint8_t*)mxGetData(data);
-  memcpy(ptr, obj.via.str.ptr, obj.via.str.size * sizeof(uint8_t));
-  if (flags.unicode_strs) {
-    // Definitely UTF-8. Convert.
-    mxArray* args[] = {data, mxCreateString("UTF-8")};
-    mexCallMATLAB(1, &ret, 2, args, "native2unicode");
-  } else {
-    // Unknown encoding. Just unpack to uint8
-    ret = data;
+  mxArray* create_empty() { return mxCreateDoubleMatrix(0, 0, mxREAL); }
+  mxArray* create_char(const char* utf8, size_t n) { return mxCreateCharFromUTF8(utf8, n); }
+  mxArray* create_cell(size_t rows, size_t cols) { return mxCreateCellMatrix(rows, cols); }
+  void set_cell(mxArray* cell, size_t i, mxArray* v) { mxSetCell(cell, i, v); }
+  mxArray* create_struct(const vector<string>& names) {
+    vector<const char*> field_names(names.size());
+    for (size_t i = 0; i < names.size(); i++) field_names[i] = names[i].c_str();
+    return mxCreateStructMatrix(1, 1, field_names.size(), field_names.data());
+  }
+  void set_field(mxArray* s, size_t i, mxArray* v) { mxSetFieldByNumber(s, 0, i, v); }
+  mxArray* to_string_array(mxArray* cellstr) {
+    mxArray* ret = NULL;
+    mexCallMATLAB(1, &ret, 1, &cellstr, "string");
+    mxDestroyArray(cellstr);
+    return ret;
   }
+  // Ext codes in ext_codecs. Malformed payloads fall back to the generic {code, bytes}.
+  bool create_ext(const ExtPayload& ext, mxArray** out) {
+    const ExtCodec& codec = ext_codecs[(uint8_t)ext.type];
+    switch (codec.kind) {
+      case EXT_KIND_COMPLEX:
+        *out = mex_unpack_complex(ext);
+        break;
+      case EXT_KIND_DATETIME:
+        *out = mex_unpack_datetime(ext);
+        break;
+      case EXT_KIND_STRING_ARRAY:
+        *out = mex_unpack_string_array(ext);
+        break;
+      case EXT_KIND_CATEGORICAL:
+        *out = mex_unpack_categorical(ext);
+        break;
+      default:
+        return decode_ext(*this, codec, ext, out);
+    }
+    return *out != NULL;
+  }
+  void destroy(mxArray* v) { mxDestroyArray(v); }
+  void error(const char* id, const char* msg) {
+    ring_release_unpacking();
+    mexErrMsgIdAndTxt(id, "%s", msg);
+  }
+  void warning(const char* id, const char* msg) { mexWarnMsgIdAndTxt(id, "%s", msg); }
+};
+
+MexBuilder mex_builder;
+ObjectUnpacker<MexBuilder> object_unpacker(mex_builder, flags, limits);
+StreamUnpacker<MexBuilder> stream_unpacker(mex_builder, flags, limits);
+
+mxArray* unpack_obj(const msgpack_object& obj) {
+  return object_unpacker.unpack(obj);
+}
+
+// Zone holding the object tree of the message being unpacked with +unpack_records or by
+// unpack_schema. An error while it is unpacked skips the cleanup, so it is also freed at the start
+// of each call.
+msgpack_zone* tree_zone = NULL;
+
+void free_tree() {
+  if (tree_zone) msgpack_zone_free(tree_zone);
+  tree_zone = NULL;
+}
+
+// Parse the complete, pre-scanned message at data[*offset] into an object tree in tree_zone and
+// advance *offset past it.
+msgpack_object parse_tree(const char* data, size_t size, size_t* offset) {
+  free_tree();
+  tree_zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  if (!tree_zone) mexErrMsgIdAndTxt("msgpack:unpack_error", "Out of memory for the message tree.");
+  return stream_unpacker.read_tree(data, size, offset, tree_zone);
+}
+
+// Unpack the complete message at data[*offset] and advance *offset past it. The bytes are decoded
+// in one pass, except with +unpack_records, which needs the object tree to look ahead.
+mxArray* unpack_message(const char* data, size_t size, size_t* offset) {
+  if (!flags.unpack_records) return stream_unpacker.unpack(data, size, offset);
+  mxArray* ret = unpack_obj(parse_tree(data, size, offset));
+  free_tree();
   return ret;
 }
 
-mxArray* mex_unpack_nil(const msgpack_object& obj) {
-  mxArray* ret = NULL;
-  switch (flags.unpack_nil) {
-    case UNPACK_NIL_ZERO:
-      ret = mxCreateDoubleScalar(0);
-      break;
-    case UNPACK_NIL_NAN:
-      ret = mxCreateDoubleScalar(mxGetNaN());
-      break;
-    case UNPACK_NIL_EMPTY:
-      ret = mxCreateDoubleMatrix(0, 0, mxREAL);
-      break;
-    case UNPACK_NIL_CELL:
-      ret = mxCreateCellArray(0, 0);
-      break;
+// Unpack an EXT_COMPLEX payload to a complex numeric row vector. Returns NULL if the payload is
+// not a valid complex block so the caller can fall back to the generic ext representation.
+mxArray* mex_unpack_complex(const ExtPayload& ext) {
+  if (ext.size < 1) return NULL;
+  const char* ptr = ext.ptr;
+  unsigned int classid = (uint8_t)ptr[0];
+  size_t elsize = numeric_class_size(classid);
+  size_t body_size = ext.size - 1;
+  if (elsize == 0 || body_size % (2 * elsize) != 0) return NULL;
+  size_t nElements = body_size / (2 * elsize);
+  mxArray* ret = mxCreateNumericMatrix(1, nElements, (mxClassID)classid, mxCOMPLEX);
+  const char* body = ptr + 1;
+#if MX_HAS_INTERLEAVED_COMPLEX
+  // Same layout as MATLAB's own storage. One copy.
+  memcpy(mxGetData(ret), body, body_size);
+#else
+  char* re = (char*)mxGetData(ret);
+  char* im = (char*)mxGetImagData(ret);
+  for (size_t i = 0; i < nElements; i++) {
+    memcpy(re + i * elsize, body + 2 * i * elsize, elsize);
+    memcpy(im + i * elsize, body + (2 * i + 1) * elsize, elsize);
   }
+#endif
   return ret;
 }
 
-mxArray* mex_unpack_map(const msgpack_object& obj) {
-  mxArray *ret = NULL;
-  uint32_t nfields = obj.via.map.size;
-  bool all_strs = true;
-  for (size_t i = 0; i < nfields; i++) {
-    if (obj.via.map.ptr[i].key.type != MSGPACK_OBJECT_STR) {
-      all_strs = false;
-      if (!flags.unpack_map_as_cells)
-        mexWarnMsgIdAndTxt("msgpack:non_str_map_keys", "Map has non-str keys. Unpacking as 2xN cells");
-      break;
-    }
+// Read a little-endian uint64 from a possibly unaligned pointer.
+uint64_t read_u64(const char* ptr) {
+  uint64_t val;
+  memcpy(&val, ptr, sizeof(uint64_t));
+  return val;
+}
+
+// Read a string block (see pack_string_block) into a 1xN cellstr. Returns NULL if malformed.
+// *consumed is set to the size of the block.
+mxArray* read_string_block(const char* ptr, size_t size, size_t* consumed) {
+  if (size < sizeof(uint64_t)) return NULL;
+  uint64_t n = read_u64(ptr);
+  if (n > size / sizeof(uint64_t)) return NULL;
+  size_t header_size = sizeof(uint64_t) * ((size_t)n + 2);
+  if (header_size > size) return NULL;
+  const char* offsets = ptr + sizeof(uint64_t);
+  const char* bytes = ptr + header_size;
+  uint64_t end = read_u64(offsets + n * sizeof(uint64_t));
+  if (read_u64(offsets) != 0 || end > size - header_size) return NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (read_u64(offsets + (i + 1) * sizeof(uint64_t)) < read_u64(offsets + i * sizeof(uint64_t)))
+      return NULL;
   }
-  if (all_strs && !flags.unpack_map_as_cells) {
-    // All str map keys. Unpack as struct
-    char **field_name = (char **)mxCalloc(nfields, sizeof(char *));
-    for (size_t i = 0; i < nfields; i++) {
-      struct msgpack_object_kv obj_kv = obj.via.map.ptr[i];
-      if (obj_kv.key.type == MSGPACK_OBJECT_STR) {
-        /* the raw size from msgpack only counts actual characters
-        * but C char array need end with \0 */
-        field_name[i] = (char*)mxCalloc(obj_kv.key.via.str.size + 1, sizeof(char));
-        memcpy((char*)field_name[i], obj_kv.key.via.str.ptr, obj_kv.key.via.str.size * sizeof(char));
-      } else {
-        mexPrintf("not string key\n");
-      }
-    }
-    ret = mxCreateStructMatrix(1, 1, obj.via.map.size, (const char**)field_name);
-    msgpack_object ob;
-    for (size_t i = 0; i < nfields; i++) {
-      int ifield = mxGetFieldNumber(ret, field_name[i]);
-      ob = obj.via.map.ptr[i].val;
-      mxSetFieldByNumber(ret, 0, ifield, unpack_obj(ob));
-    }
-    for (size_t i = 0; i < nfields; i++)
-      mxFree((void *)field_name[i]);
-    mxFree(field_name);
-  } else {
-    // unpack as cells.
-    ret = mxCreateCellMatrix(2, nfields);
-    mwIndex key_subs[] = {0, 0};
-    mwIndex val_subs[] = {1, 0};
-    size_t key_i, val_i;
-    key_i = val_i = 0;
-    msgpack_object * key = NULL;
-    msgpack_object * val = NULL;
-    for (size_t i = 0; i < nfields; i++) {
-      // Get cell indices
-      key_subs[1] = i;
-      key_i = mxCalcSingleSubscript(ret, 2, key_subs);
-      val_subs[1] = i;
-      val_i = mxCalcSingleSubscript(ret, 2, val_subs);
-      key = &(obj.via.map.ptr[i].key);
-      val = &(obj.via.map.ptr[i].val);
-      mxSetCell(ret, key_i, unpack_obj(*key));
-      mxSetCell(ret, val_i, unpack_obj(*val));
-    }
+  mxArray* ret = mxCreateCellMatrix(1, n);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t start = read_u64(offsets + i * sizeof(uint64_t));
+    uint64_t stop = read_u64(offsets + (i + 1) * sizeof(uint64_t));
+    mxSetCell(ret, i, mxCreateCharFromUTF8(bytes + start, stop - start));
   }
+  *consumed = header_size + end;
   return ret;
 }
 
-mxArray* mex_unpack_array(const msgpack_object& obj) {
+mxArray* mex_unpack_string_array(const ExtPayload& ext) {
+  size_t consumed = 0;
+  mxArray* cells = read_string_block(ext.ptr, ext.size, &consumed);
+  if (!cells || consumed != ext.size) return NULL;
   mxArray* ret = NULL;
-  // Short circuit--empty array returns [];
-  if (obj.via.array.size == 0) {
-    ret = mxCreateDoubleMatrix(0, 0, mxREAL);
-    return ret;
-  }
-  // Figure out if the array is all of one scalar type, (or one type with nils)
-  int unique_scalar_type = -1;  // msgpack_object_type
-  bool one_scalar_type = true;
-  int this_type;
-  vector<bool> nils(obj.via.array.size, false);
-  for (size_t i = 0; i < obj.via.array.size; i++) {
-    this_type = obj.via.array.ptr[i].type;
-    if (this_type == 0x00) {
-        nils[i] = true;
-        continue;
-    }
-    if (unique_scalar_type > -1) { // At least one scalar type has been found
-      if (this_type != unique_scalar_type) {
-        // Different type. Can't make an array.
-        one_scalar_type = false;
-        break;
-      }
-    } else if (this_type > 0x00 && (this_type < 0x05 || this_type == 0x0a)) {
-      // Found a scalar non-nil type
-      unique_scalar_type = this_type;
-    } else {
-      // Non-scalar type. Can't make an array.
-      one_scalar_type = false;
-      break;
-    }
-  }
-  bool all_nils = (unique_scalar_type == -1);
-  bool any_nils = std::any_of(nils.begin(), nils.end(), [](bool v) {return v;});
-  // mexPrintf("unique_scalar_type: %d, one_scalar_type: %d, all_nils: %d, any_nils: %d\n",
-  //           unique_scalar_type, one_scalar_type, all_nils, any_nils);
-
-  // Single-type array if...
-  // - All scalar of same type and no nills
-  // - All scalar of same type and skip nil
-  // - All scalar of same type and nil-->zero
-  // - All scalar of float/double type and nil-->NaN
-  // - All nil and (nil-->Nan or nil-->zero)
-  // ...otherwise cell array
-  if ((one_scalar_type &&
-       (!any_nils ||
-        flags.unpack_nil_array_skip ||
-        flags.unpack_nil == UNPACK_NIL_ZERO ||
-        (flags.unpack_nil == UNPACK_NIL_NAN && (unique_scalar_type == 0x04 ||
-                                                unique_scalar_type == 0x0a)))) ||
-      (all_nils && (flags.unpack_nil == UNPACK_NIL_NAN || flags.unpack_nil == UNPACK_NIL_ZERO))){
-    // Unpack to single-type MATLAB array
-    // First handle the three all-nil cases.
-    if (all_nils) {
-      if (flags.unpack_nil_array_skip) {
-        ret = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, mxREAL);
-      } else if (flags.unpack_nil == UNPACK_NIL_ZERO) {
-        ret = mxCreateNumericMatrix(1, obj.via.array.size, mxUINT8_CLASS, mxREAL);
-      } else {
-        ret = mxCreateNumericMatrix(1, obj.via.array.size, mxDOUBLE_CLASS, mxREAL);
-        double* ptr = mxGetPr(ret);
-        for (size_t i = 0; i < obj.via.array.size; i++) ptr[i] = mxGetNaN();
-      }
-    } else {
-      // Ok, there are between 0 and n-1 nils. Create the arrays.
-      size_t nskip = 0;
-      if (any_nils && flags.unpack_nil_array_skip) {
-        nskip = std::count_if(nils.begin(), nils.end(), [](bool v) {return v;});
-      }
-      bool* ptrb = NULL;
-      uint64_t* ptru = NULL;
-      int64_t* ptri = NULL;
-      float* ptrf = NULL;
-      double* ptrd = NULL;
-      switch (unique_scalar_type) {
-        case MSGPACK_OBJECT_BOOLEAN:
-          ret = mxCreateLogicalMatrix(1, obj.via.array.size - nskip);
-          ptrb = (bool*)mxGetData(ret);
-          if (!any_nils) {
-            // No nils, copy in bool values.
-            for (size_t i = 0; i < obj.via.array.size; i++)
-              ptrb[i] = obj.via.array.ptr[i].via.boolean;
-          } else {
-            if (flags.unpack_nil_array_skip) {
-              // Some nils, skip them
-              size_t ptr_i = 0;
-              for (size_t obj_i = 0; obj_i < obj.via.array.size; obj_i++) {
-                if (nils[obj_i]) continue;
-                else ptrb[ptr_i++] = obj.via.array.ptr[obj_i].via.boolean; // incr ptr_i after use
-              }
-            } else {
-              // some nils, set them false.
-              for (size_t i = 0; i < obj.via.array.size; i++) {
-                if (nils[i]) ptrb[i] = false;
-                else ptrb[i] = obj.via.array.ptr[i].via.boolean;
-              }
-            }
-          }
-          break;
-        case MSGPACK_OBJECT_POSITIVE_INTEGER:
-          ret = mxCreateNumericMatrix(1, obj.via.array.size - nskip, mxUINT64_CLASS, mxREAL);
-          ptru = (uint64_t*)mxGetData(ret);
-          if (!any_nils) {
-            // no nils, copy in uints
-            for (size_t i = 0; i < obj.via.array.size; i++)
-              ptru[i] = obj.via.array.ptr[i].via.u64;
-          } else {
-            if (flags.unpack_nil_array_skip) {
-              // Some nils, skip them
-              size_t ptr_i = 0;
-              for (size_t obj_i = 0; obj_i < obj.via.array.size; obj_i++) {
-                if (nils[obj_i]) continue;
-                else ptru[ptr_i++] = obj.via.array.ptr[obj_i].via.u64; // incr ptr_i after use
-              }
-            } else {
-              // some nils, set them to zero
-              for (size_t i = 0; i < obj.via.array.size; i++) {
-                if (nils[i]) ptru[i] = 0;
-                else ptru[i] = obj.via.array.ptr[i].via.u64;
-              }
-            }
-          }
-          break;
-        case MSGPACK_OBJECT_NEGATIVE_INTEGER:
-          ret = mxCreateNumericMatrix(1, obj.via.array.size - nskip, mxINT64_CLASS, mxREAL);
-          ptri = (int64_t*)mxGetData(ret);
-          if (!any_nils) {
-            // no nils, copy in ints
-            for (size_t i = 0; i < obj.via.array.size; i++)
-              ptri[i] = obj.via.array.ptr[i].via.i64;
-          } else {
-            if (flags.unpack_nil_array_skip) {
-              // Some nils, skip them
-              size_t ptr_i = 0;
-              for (size_t obj_i = 0; obj_i < obj.via.array.size; obj_i++) {
-                if (nils[obj_i]) continue;
-                else ptri[ptr_i++] = obj.via.array.ptr[obj_i].via.i64; // incr ptr_i after use
-              }
-            } else {
-              // some nils, set them to zero
-              for (size_t i = 0; i < obj.via.array.size; i++) {
-                if (nils[i]) ptri[i] = 0;
-                else ptri[i] = obj.via.array.ptr[i].via.i64;
-              }
-            }
-          }
-          break;
-        case MSGPACK_OBJECT_FLOAT32:
-          ret = mxCreateNumericMatrix(1, obj.via.array.size - nskip, mxSINGLE_CLASS, mxREAL);
-          ptrf = (float*)mxGetData(ret);
-          if (!any_nils) {
-            // no nils, copy in vals
-            for (size_t i = 0; i < obj.via.array.size; i++)
-              ptrf[i] = (float)obj.via.array.ptr[i].via.f64;
-          } else {
-            if (flags.unpack_nil_array_skip) {
-              // Some nils, skip them
-              size_t ptr_i = 0;
-              for (size_t obj_i = 0; obj_i < obj.via.array.size; obj_i++) {
-                if (nils[obj_i]) continue;
-                else ptrf[ptr_i++] = (float)obj.via.array.ptr[obj_i].via.f64; // incr ptr_i after use
-              }
-            } else {
-              // some nils, set them to zero or NaN.
-              float nil_val = (flags.unpack_nil == UNPACK_NIL_NAN) ? mxGetNaN() : 0;
-              for (size_t i = 0; i < obj.via.array.size; i++) {
-                if (nils[i]) ptrf[i] = nil_val;
-                else ptrf[i] = (float)obj.via.array.ptr[i].via.f64;
-              }
-            }
-          }
-          break;
-        case MSGPACK_OBJECT_FLOAT64:
-          ret = mxCreateNumericMatrix(1, obj.via.array.size - nskip, mxDOUBLE_CLASS, mxREAL);
-          ptrd = mxGetPr(ret);
-          if (!any_nils) {
-            // no nils, copy in vals
-            for (size_t i = 0; i < obj.via.array.size; i++)
-              ptrd[i] = obj.via.array.ptr[i].via.f64;
-          } else {
-            if (flags.unpack_nil_array_skip) {
-              // Some nils, skip them
-              size_t ptr_i = 0;
-              for (size_t obj_i = 0; obj_i < obj.via.array.size; obj_i++) {
-                if (nils[obj_i]) continue;
-                else ptrd[ptr_i++] = obj.via.array.ptr[obj_i].via.f64; // incr ptr_i after use
-              }
-            } else {
-              // some nils, set them to zero or NaN.
-              double nil_val = (flags.unpack_nil == UNPACK_NIL_NAN) ? mxGetNaN() : 0;
-              for (size_t i = 0; i < obj.via.array.size; i++) {
-                if (nils[i]) ptrd[i] = nil_val;
-                else ptrd[i] = obj.via.array.ptr[i].via.f64;
-              }
-            }
-          }
-          break;
-        default:
-         mexErrMsgIdAndTxt("msgpack:invalid_object_type",
-                           "Shouldn't get here. Object type is %d", unique_scalar_type);
-      }
-    }
-  } else {
-    // Unpack to cell array
-    ret = mxCreateCellMatrix(1, obj.via.array.size);
-    for (size_t i = 0; i < obj.via.array.size; i++) {
-      msgpack_object ob = obj.via.array.ptr[i];
-      mxSetCell(ret, i, unpack_obj(ob));
-    }
-  }
+  mexCallMATLAB(1, &ret, 1, &cells, "string");
+  mxDestroyArray(cells);
   return ret;
 }
 
-mxArray* mex_unpack_bin(const msgpack_object& obj){
-  mxArray* ret = mxCreateNumericMatrix(1, obj.via.bin.size, mxUINT8_CLASS, mxREAL);
-  uint8_t *ptr = (uint8_t*)mxGetData(ret);
-  memcpy(ptr, obj.via.bin.ptr, obj.via.bin.size * sizeof(uint8_t));
+mxArray* mex_unpack_categorical(const ExtPayload& ext) {
+  if (ext.size < 1) return NULL;
+  size_t width = (uint8_t)ext.ptr[0];
+  if (width != 1 && width != 2 && width != 4) return NULL;
+  size_t consumed = 0;
+  mxArray* cats = read_string_block(ext.ptr + 1, ext.size - 1, &consumed);
+  if (!cats) return NULL;
+  size_t codes_size = ext.size - 1 - consumed;
+  if (codes_size % width != 0) {
+    mxDestroyArray(cats);
+    return NULL;
+  }
+  const uint8_t* src = (const uint8_t*)ext.ptr + 1 + consumed;
+  size_t nElements = codes_size / width;
+  size_t ncats = mxGetNumberOfElements(cats);
+  // categorical(codes, 1:ncats, cats): codes outside the value set (i.e. 0) are undefined.
+  mxArray* codes = mxCreateNumericMatrix(1, nElements, mxDOUBLE_CLASS, mxREAL);
+  double* ptrd = mxGetPr(codes);
+  for (size_t i = 0; i < nElements; i++) {
+    uint32_t code = 0;
+    memcpy(&code, src + i * width, width);  // little-endian
+    ptrd[i] = code;
+  }
+  mxArray* valueset = mxCreateNumericMatrix(1, ncats, mxDOUBLE_CLASS, mxREAL);
+  ptrd = mxGetPr(valueset);
+  for (size_t i = 0; i < ncats; i++) ptrd[i] = i + 1;
+  mxArray* args[] = {codes, valueset, cats};
+  mxArray* ret = NULL;
+  mexCallMATLAB(1, &ret, 3, args, "categorical");
+  mxDestroyArray(codes);
+  mxDestroyArray(valueset);
+  mxDestroyArray(cats);
   return ret;
 }
 
-mxArray* mex_unpack_ext(const msgpack_object& obj){
+mxArray* mex_unpack_datetime(const ExtPayload& ext) {
+  if (ext.size % sizeof(double) != 0) return NULL;
+  size_t nElements = ext.size / sizeof(double);
+  mxArray* secs = mxCreateNumericMatrix(1, nElements, mxDOUBLE_CLASS, mxREAL);
+  memcpy(mxGetPr(secs), ext.ptr, ext.size);
+  mxArray* args[] = {secs, mxCreateString("ConvertFrom"), mxCreateString("posixtime")};
   mxArray* ret = NULL;
-  int type_cell = 0;
-  int data_cell = 1;
-  if (flags.unpack_ext_w_tag) {
-    type_cell++;
-    data_cell++;
-    ret = mxCreateCellMatrix(1, 3);
-    mxSetCell(ret, 0, mxCreateString("MSGPACK_EXT"));
-  } else {
-    ret = mxCreateCellMatrix(1, 2);
-  }
-  mxArray* exttype = mxCreateDoubleScalar(obj.via.ext.type);
-  mxArray* data = mxCreateNumericMatrix(1, obj.via.ext.size, mxUINT8_CLASS, mxREAL);
-  uint8_t *ptr = (uint8_t*)mxGetData(data);
-  memcpy(ptr, obj.via.ext.ptr, obj.via.ext.size * sizeof(uint8_t));
-  mxSetCell(ret, type_cell, exttype);
-  mxSetCell(ret, data_cell, data);
+  mexCallMATLAB(1, &ret, 3, args, "datetime");
+  for (int i = 0; i < 3; i++) mxDestroyArray(args[i]);
   return ret;
 }
 
+// Pre-scan the message at data + offset and raise an error if it is malformed or over a limit
+// (releasing a ring record first, see unpacking_ring). Returns false if it is incomplete.
+bool prescan_or_error(const char* data, size_t size, size_t offset) {
+  PrescanStats stats;
+  PrescanResult result = prescan_message(data + offset, size - offset, limits, &stats);
+  if (result == PRESCAN_OK) return true;
+  if (result == PRESCAN_INCOMPLETE) return false;
+  ring_release_unpacking();
+  switch (result) {
+    case PRESCAN_MALFORMED:
+      mexErrMsgIdAndTxt("msgpack:unpack_error", "unpack error at offset %zu", offset + stats.bytes);
+    default:  // PRESCAN_LIMIT
+      if (!strcmp(stats.limit, "max_depth"))
+        mexErrMsgIdAndTxt("msgpack:max_depth", "Nesting deeper than max_depth=%zu.",
+                          limits.max_depth);
+      mexErrMsgIdAndTxt("msgpack:limit_exceeded", "Message at offset %zu exceeds %s.", offset,
+                        stats.limit);
+  }
+  return false;
+}
+
 void mex_unpack(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
   const char *str = (const char*)mxGetData(prhs[0]);
-  int size = mxGetM(prhs[0]) * mxGetN(prhs[0]);
+  size_t size = mxGetNumberOfElements(prhs[0]);
 
   /* deserializes it. */
-  msgpack_unpacked msg;
-  msgpack_unpacked_init(&msg);
-  if (!msgpack_unpack_next(&msg, str, size, NULL))
-    mexErrMsgTxt("unpack error");
-
-  /* prints the deserialized object. */
-  msgpack_object obj = msg.data;
-
-  plhs[0] = unpack_obj(obj);
+  size_t offset = 0;
+  if (!prescan_or_error(str, size, 0))
+    mexErrMsgIdAndTxt("msgpack:unpack_error", "Incomplete message.");
+  plhs[0] = unpack_message(str, size, &offset);
 }
 
+// Pack prhs and everything below it. Cells and structs push frames onto pack_stack instead of
+// recursing; this loop packs their contents depth-first.
 void pack_mxArray(msgpack_packer *pk, int nrhs, const mxArray* prhs) {
+  size_t base = pack_stack.size();
+  pack_depth = 0;
+  pack_node(pk, nrhs, prhs);
+  while (pack_stack.size() > base) {
+    PackFrame& frame = pack_stack.back();
+    if (frame.i == frame.n) {
+      if (frame.owned) mxDestroyArray(frame.owned);
+      pack_stack.pop_back();
+      continue;
+    }
+    size_t i = frame.i++;
+    const mxArray* child = NULL;
+    if (frame.kind == PACK_FRAME_CELL) {
+      if (frame.chunk_len && i % frame.chunk_len == 0)
+        msgpack_pack_array(pk, std::min(frame.chunk_len, frame.n - i));
+      child = mxGetCell(frame.arr, i);
+    } else {
+      const char* field_name = mxGetFieldNameByNumber(frame.arr, i);
+      size_t fieldname_len = strlen(field_name);
+      msgpack_pack_str(pk, fieldname_len);
+      msgpack_pack_str_body(pk, field_name, fieldname_len);
+      child = mxGetFieldByNumber(frame.arr, 0, i);
+    }
+    pack_depth = frame.depth;
+    // These may push frames, invalidating `frame`.
+    if (frame.kind == PACK_FRAME_TABLE)
+      pack_table_variable(pk, nrhs, child);
+    else
+      pack_node(pk, nrhs, child);
+  }
+}
+
+void pack_node(msgpack_packer *pk, int nrhs, const mxArray* prhs) {
   unsigned int classid = mxGetClassID(prhs);
   if (classid > 0 && classid < 16 && classid != 5) {
-    (*PackMap[classid])(pk, nrhs, prhs);
+    if (mxIsComplex(prhs))
+      mex_pack_complex(pk, nrhs, prhs);
+    else
+      (*PackMap[classid])(pk, nrhs, prhs);
   } else {
     // 0 is UNKNOWN, 5 is VOID, 16-18 are FUNCTION, OPAQUE, & OBJECT
     const char* classname = mxGetClassName(prhs);
+    for (size_t i = 0; i < sizeof(ObjectPackMap) / sizeof(ObjectPackMap[0]); i++) {
+      if (mxIsClass(prhs, ObjectPackMap[i].classname)) {
+        (*ObjectPackMap[i].fn)(pk, nrhs, prhs);
+        return;
+      }
+    }
     if (flags.pack_other_as_nil) {
       mexWarnMsgIdAndTxt("msgpack:pack_other_as_nil",
                          "Packing class id %u (%s) as nil", classid, classname);
@@ -568,108 +579,322 @@ void pack_mxArray(msgpack_packer *pk, int nrhs, const mxArray* prhs) {
   }
 }
 
+// Longest array, str, bin or ext packed in one piece. MessagePack lengths are 32-bit, so longer
+// ones are split into a chunked container (see EXT_CHUNKED).
+size_t pack_chunk_len() {
+  return std::max<size_t>(1, std::min<size_t>(limits.max_chunk_len, UINT32_MAX));
+}
+
+// Start a chunked container of total elements or bytes in pieces of len: the outer array header
+// and the marker. Returns the number of pieces.
+size_t pack_chunk_marker(msgpack_packer *pk, size_t total, size_t len) {
+  size_t nchunks = total / len + (total % len != 0);
+  if (nchunks >= UINT32_MAX)
+    mexErrMsgIdAndTxt("msgpack:too_large", "%zu elements or bytes need too many chunks of %zu.",
+                      total, len);
+  uint64_t total_le = total;  // little-endian
+  msgpack_pack_array(pk, 1 + nchunks);
+  msgpack_pack_ext(pk, sizeof(total_le), EXT_CHUNKED);
+  msgpack_pack_ext_body(pk, &total_le, sizeof(total_le));
+  return nchunks;
+}
+
+// Pack n elements with pack_elem: a bare value if n is 1, otherwise an array, chunked if it is
+// longer than pack_chunk_len().
+template <typename T, typename PackElem>
+void pack_elements(msgpack_packer *pk, const T* data, size_t n, PackElem pack_elem) {
+  size_t len = pack_chunk_len();
+  if (n > len) {
+    pack_chunk_marker(pk, n, len);
+    for (size_t start = 0; start < n; start += len) {
+      size_t stop = std::min(n, start + len);
+      msgpack_pack_array(pk, stop - start);
+      for (size_t i = start; i < stop; i++) pack_elem(pk, data[i]);
+    }
+    return;
+  }
+  if (n > 1) msgpack_pack_array(pk, n);
+  for (size_t i = 0; i < n; i++) pack_elem(pk, data[i]);
+}
+
+// Packs a str, bin or ext of size bytes whose body is handed over in one or more write() calls.
+// A body longer than pack_chunk_len() becomes a chunked container of pieces of the same type.
+struct RawPacker {
+  msgpack_packer* pk;
+  msgpack_object_type type;  // MSGPACK_OBJECT_STR, _BIN or _EXT
+  int8_t code;               // For ext
+  size_t size;               // Total bytes
+  size_t len;                // Bytes per piece
+  size_t written;
+  size_t left;               // Bytes still to write to the current piece
+
+  RawPacker(msgpack_packer *pk, msgpack_object_type type, size_t size, int8_t code = 0)
+      : pk(pk), type(type), code(code), size(size), len(pack_chunk_len()), written(0), left(0) {
+    if (size > len) {
+      pack_chunk_marker(pk, size, len);
+    } else {
+      header(size);
+      left = size;
+    }
+  }
+
+  void header(size_t n) {
+    switch (type) {
+      case MSGPACK_OBJECT_STR: msgpack_pack_str(pk, n); break;
+      case MSGPACK_OBJECT_BIN: msgpack_pack_bin(pk, n); break;
+      default: msgpack_pack_ext(pk, n, code); break;  // MSGPACK_OBJECT_EXT
+    }
+  }
+
+  void write(const void* data, size_t n) {
+    const char* ptr = (const char*)data;
+    while (n) {
+      if (!left) {
+        left = std::min(len, size - written);
+        header(left);
+      }
+      size_t k = std::min(n, left);
+      switch (type) {
+        case MSGPACK_OBJECT_STR: msgpack_pack_str_body(pk, ptr, k); break;
+        case MSGPACK_OBJECT_BIN: msgpack_pack_bin_body(pk, ptr, k); break;
+        default: msgpack_pack_ext_body(pk, ptr, k); break;  // MSGPACK_OBJECT_EXT
+      }
+      ptr += k;
+      n -= k;
+      left -= k;
+      written += k;
+    }
+  }
+};
+
+// Pack a complex numeric array as a single EXT_COMPLEX block of interleaved real/imag values.
+void mex_pack_complex(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
+  unsigned int classid = mxGetClassID(prhs);
+  size_t elsize = numeric_class_size(classid);
+  size_t nElements = mxGetNumberOfElements(prhs);
+  size_t body_size = 2 * nElements * elsize;
+  uint8_t class_byte = classid;
+  RawPacker raw(pk, MSGPACK_OBJECT_EXT, 1 + body_size, EXT_COMPLEX);
+  raw.write(&class_byte, 1);
+#if MX_HAS_INTERLEAVED_COMPLEX
+  raw.write(mxGetData(prhs), body_size);
+#else
+  // Interleave through a small stack buffer so the whole array is never copied at once.
+  const char* re = (const char*)mxGetData(prhs);
+  const char* im = (const char*)mxGetImagData(prhs);
+  char chunk[4096];
+  size_t per_chunk = sizeof(chunk) / (2 * elsize);
+  for (size_t i = 0; i < nElements; i += per_chunk) {
+    size_t n = std::min(per_chunk, nElements - i);
+    for (size_t k = 0; k < n; k++) {
+      memcpy(chunk + 2 * k * elsize, re + (i + k) * elsize, elsize);
+      memcpy(chunk + (2 * k + 1) * elsize, im + (i + k) * elsize, elsize);
+    }
+    raw.write(chunk, 2 * n * elsize);
+  }
+#endif
+}
+
+void append_u64(string& out, uint64_t val) {
+  out.append((const char*)&val, sizeof(uint64_t));  // little-endian
+}
+
+// Append a string block for a cellstr to out: uint64 count N, N+1 uint64 byte offsets (the first
+// is 0), then the UTF-8 bytes of all strings back to back. A block over 4 GB is packed as a
+// chunked ext like any other.
+void pack_string_block(string& out, const mxArray* cellstr) {
+  size_t nElements = mxGetNumberOfElements(cellstr);
+  string bytes;
+  append_u64(out, nElements);
+  append_u64(out, 0);
+  for (size_t i = 0; i < nElements; i++) {
+    mxArray* str = mxGetCell(cellstr, i);
+    utf16_to_utf8((const mxChar*)mxGetData(str), mxGetNumberOfElements(str), bytes);
+    append_u64(out, bytes.size());
+  }
+  out += bytes;
+}
+
+// MATLAB string array as a single EXT_STRING_ARRAY block holding all elements, or as a plain str
+// like a char array if it is scalar and scalar_as_str is set. Missing strings are packed as "".
+void pack_string_array(msgpack_packer *pk, const mxArray *prhs, bool scalar_as_str) {
+  mxArray* cellstr = NULL;
+  mexCallMATLAB(1, &cellstr, 1, (mxArray **)&prhs, "cellstr");
+  string payload;
+  if (scalar_as_str && mxGetNumberOfElements(cellstr) == 1) {
+    mxArray* str = mxGetCell(cellstr, 0);
+    utf16_to_utf8((const mxChar*)mxGetData(str), mxGetNumberOfElements(str), payload);
+    RawPacker(pk, MSGPACK_OBJECT_STR, payload.size()).write(payload.data(), payload.size());
+  } else {
+    pack_string_block(payload, cellstr);
+    RawPacker(pk, MSGPACK_OBJECT_EXT, payload.size(), EXT_STRING_ARRAY)
+        .write(payload.data(), payload.size());
+  }
+  mxDestroyArray(cellstr);
+}
+
+void mex_pack_string(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
+  pack_string_array(pk, prhs, true);
+}
+
+// categorical array as a dictionary of category names plus integer codes.
+void mex_pack_categorical(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
+  mxArray* cats = NULL;
+  mxArray* codes = NULL;
+  mexCallMATLAB(1, &cats, 1, (mxArray **)&prhs, "categories");
+  mexCallMATLAB(1, &codes, 1, (mxArray **)&prhs, "double");  // NaN for undefined
+  size_t ncats = mxGetNumberOfElements(cats);
+  uint8_t width = (ncats <= UINT8_MAX) ? 1 : (ncats <= UINT16_MAX) ? 2 : 4;
+  string payload(1, (char)width);
+  pack_string_block(payload, cats);
+  size_t nElements = mxGetNumberOfElements(codes);
+  double* ptrd = mxGetPr(codes);
+  size_t start = payload.size();
+  payload.resize(start + nElements * width);
+  for (size_t i = 0; i < nElements; i++) {
+    uint32_t code = mxIsNaN(ptrd[i]) ? 0 : (uint32_t)ptrd[i];
+    memcpy(&payload[start + i * width], &code, width);  // little-endian
+  }
+  RawPacker(pk, MSGPACK_OBJECT_EXT, payload.size(), EXT_CATEGORICAL)
+      .write(payload.data(), payload.size());
+  mxDestroyArray(cats);
+  mxDestroyArray(codes);
+}
+
+// datetime array as POSIX seconds.
+void mex_pack_datetime(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
+  mxArray* secs = NULL;
+  mexCallMATLAB(1, &secs, 1, (mxArray **)&prhs, "posixtime");
+  size_t nbytes = mxGetNumberOfElements(secs) * sizeof(double);
+  RawPacker(pk, MSGPACK_OBJECT_EXT, nbytes, EXT_DATETIME).write(mxGetPr(secs), nbytes);
+  mxDestroyArray(secs);
+}
+
+// table as a map of variable name to column (see pack_table_variable).
+void mex_pack_table(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
+  mxArray* args[] = {(mxArray *)prhs, mxCreateString("ToScalar"), mxCreateLogicalScalar(true)};
+  mxArray* columns = NULL;
+  mexCallMATLAB(1, &columns, 3, args, "table2struct");
+  size_t nField = mxGetNumberOfFields(columns);
+  msgpack_pack_map(pk, nField);
+  push_pack_frame(PACK_FRAME_TABLE, columns, columns, nField);
+  mxDestroyArray(args[1]);
+  mxDestroyArray(args[2]);
+}
+
+// One variable of a table. A plain column is packed as usual, except that strings are always a
+// string block. Anything else (more than one column, no rows, or a cell variable of a one-row
+// table) is packed as [EXT_TABLE_SHAPE marker, elements in column-major order], with the elements
+// in an array even if there are fewer than two, so unpack_table can restore its size.
+void pack_table_variable(msgpack_packer *pk, int nrhs, const mxArray* var) {
+  // Plain arrays carry their own dimensions. Only objects (string, categorical, datetime, ...)
+  // need a call to size, since the mxArray of an object doesn't describe its shape.
+  vector<uint64_t> dims;  // little-endian
+  if (mxIsNumeric(var) || mxIsLogical(var) || mxIsChar(var) || mxIsCell(var) || mxIsStruct(var)) {
+    const mwSize* var_dims = mxGetDimensions(var);
+    dims.assign(var_dims, var_dims + mxGetNumberOfDimensions(var));
+  } else {
+    mxArray* size_arr = NULL;
+    mexCallMATLAB(1, &size_arr, 1, (mxArray **)&var, "size");
+    const double* size_pr = mxGetPr(size_arr);
+    dims.assign(size_pr, size_pr + mxGetNumberOfElements(size_arr));
+    mxDestroyArray(size_arr);
+  }
+  size_t ndims = dims.size();
+  size_t nElements = 1;
+  for (size_t k = 0; k < ndims; k++) nElements *= (size_t)dims[k];
+  bool is_cell = mxIsCell(var);
+  if (ndims > 2 || dims[1] != 1 || nElements == 0 || (is_cell && nElements == 1)) {
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_ext(pk, ndims * sizeof(uint64_t), EXT_TABLE_SHAPE);
+    msgpack_pack_ext_body(pk, dims.data(), ndims * sizeof(uint64_t));
+    if (is_cell && nElements <= 1) {
+      // mex_pack_cell would pack one cell bare, and no cells as nothing at all.
+      msgpack_pack_array(pk, nElements);
+      push_pack_frame(PACK_FRAME_CELL, var, NULL, nElements);
+      return;
+    }
+    if (nElements == 0 && (mxIsNumeric(var) || mxIsLogical(var)) && !mxIsComplex(var)) {
+      msgpack_pack_array(pk, 0);  // pack_elements packs nothing for no elements
+      return;
+    }
+  }
+  if (mxIsClass(var, "string"))
+    pack_string_array(pk, var, false);
+  else
+    pack_node(pk, nrhs, var);
+}
+
 void mex_pack_single(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   float *data = (float*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_float(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_float);
 }
 
 void mex_pack_double(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   double *data = mxGetPr(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_double(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_double);
 }
 
 void mex_pack_int8(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   int8_t *data = (int8_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_int8(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_int8);
 }
 
 void mex_pack_uint8(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   uint8_t *data = (uint8_t*)mxGetData(prhs);
   if (flags.pack_u8_bin) {
-    msgpack_pack_bin(pk, nElements);
-    msgpack_pack_bin_body(pk, data, sizeof(uint8_t)*nElements);
+    RawPacker(pk, MSGPACK_OBJECT_BIN, nElements).write(data, sizeof(uint8_t)*nElements);
   } else {
-    if (nElements > 1)
-      msgpack_pack_array(pk, nElements);
-    for (int i = 0; i < nElements; i++) {
-      msgpack_pack_uint8(pk, data[i]);
-    }
+    pack_elements(pk, data, nElements, msgpack_pack_uint8);
   }
 }
 
 void mex_pack_int16(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   int16_t *data = (int16_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_int16(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_int16);
 }
 
 void mex_pack_uint16(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   uint16_t *data = (uint16_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_uint16(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_uint16);
 }
 
 void mex_pack_int32(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   int32_t *data = (int32_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_int32(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_int32);
 }
 
 void mex_pack_uint32(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   uint32_t *data = (uint32_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_uint32(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_uint32);
 }
 
 void mex_pack_int64(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   int64_t *data = (int64_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_int64(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_int64);
 }
 
 void mex_pack_uint64(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   uint64_t *data = (uint64_t*)mxGetData(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++) {
-    msgpack_pack_uint64(pk, data[i]);
-  }
+  pack_elements(pk, data, nElements, msgpack_pack_uint64);
 }
 
 void mex_pack_logical(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nElements = mxGetNumberOfElements(prhs);
+  size_t nElements = mxGetNumberOfElements(prhs);
   bool *data = mxGetLogicals(prhs);
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (int i = 0; i < nElements; i++)
-    (data[i])? msgpack_pack_true(pk) : msgpack_pack_false(pk);
+  pack_elements(pk, data, nElements, [](msgpack_packer *pk, bool val) {
+    return val ? msgpack_pack_true(pk) : msgpack_pack_false(pk);
+  });
 }
 
 void mex_pack_char(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
@@ -694,12 +919,104 @@ void mex_pack_char(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
       buf[i] = ptr[i];
     }
   }
-  msgpack_pack_str(pk, str_len);
-  msgpack_pack_str_body(pk, buf, str_len);
+  RawPacker(pk, MSGPACK_OBJECT_STR, str_len).write(buf, str_len);
 
   mxFree(buf);
 }
 
+// An ext code argument: an integer in [-128, 127].
+// Read an ext code. Returns false if arg isn't an integral scalar in range [-128, 127].
+bool read_ext_code(const mxArray* arg, int8_t* code) {
+  double val = (mxIsNumeric(arg) && mxIsScalar(arg)) ? mxGetScalar(arg) : 0.5;
+  if (!(val >= -128 && val <= 127) || val != (int)val) return false;
+  *code = (int8_t)val;
+  return true;
+}
+
+int8_t get_ext_code(const mxArray* arg) {
+  int8_t code = 0;
+  if (!read_ext_code(arg, &code)) {
+    mexErrMsgIdAndTxt("msgpack:invalid_ext_code",
+                      "ext code must be integral in range [-128, 127]");
+  }
+  return code;
+}
+
+// Round to the nearest integer of type T. Returns the index of the first value that doesn't fit
+// in T (NaN included), or n if they all do.
+template <typename T>
+size_t encode_fixed(const double* src, size_t n, double scale, char* dst) {
+  // hi is max + 1, which is exact in double even where max itself isn't (64-bit types)
+  const double lo = (double)std::numeric_limits<T>::min();
+  const double hi = 2 * (double)(std::numeric_limits<T>::max() / 2 + 1);
+  for (size_t i = 0; i < n; i++) {
+    double v = round(src[i] / scale);
+    if (!(v >= lo && v < hi)) return i;
+    T raw = (T)v;
+    memcpy(dst + i * sizeof(T), &raw, sizeof(T));  // little-endian
+  }
+  return n;
+}
+
+// Pack data as ext code with the typed, bitset or fixed encoder registered for it. Returns false
+// if the code has none.
+bool pack_registered_ext(msgpack_packer *pk, int8_t code, const mxArray* data) {
+  const ExtCodec& codec = ext_codecs[(uint8_t)code];
+  size_t nElements = mxGetNumberOfElements(data);
+  size_t elsize = num_class_size[codec.cls];
+  switch (codec.kind) {
+    case EXT_KIND_TYPED:
+      if (mxGetClassID(data) != num_classids[codec.cls] || mxIsComplex(data)) {
+        mexErrMsgIdAndTxt("msgpack:ext_encode", "ext code %d needs real %s data.", code,
+                          num_class_names[codec.cls]);
+      }
+      // Same layout as MATLAB's own storage. One copy.
+      RawPacker(pk, MSGPACK_OBJECT_EXT, nElements * elsize, code)
+          .write(mxGetData(data), nElements * elsize);
+      return true;
+    case EXT_KIND_BITSET: {
+      if (!mxIsLogical(data))
+        mexErrMsgIdAndTxt("msgpack:ext_encode", "ext code %d needs logical data.", code);
+      const mxLogical* bits = mxGetLogicals(data);
+      // The bit count goes first, so a length that isn't a multiple of 8 comes back as it was
+      uint64_t nbits = nElements;
+      vector<uint8_t> bytes(sizeof(nbits) + (nElements + 7) / 8, 0);
+      memcpy(bytes.data(), &nbits, sizeof(nbits));  // little-endian
+      for (size_t i = 0; i < nElements; i++) {
+        if (bits[i]) bytes[sizeof(nbits) + (i >> 3)] |= 1 << (i & 7);
+      }
+      RawPacker(pk, MSGPACK_OBJECT_EXT, bytes.size(), code).write(bytes.data(), bytes.size());
+      return true;
+    }
+    case EXT_KIND_FIXED: {
+      if (!mxIsDouble(data) || mxIsComplex(data))
+        mexErrMsgIdAndTxt("msgpack:ext_encode", "ext code %d needs real double data.", code);
+      const double* src = (const double*)mxGetData(data);
+      vector<char> bytes(nElements * elsize);
+      char* dst = bytes.data();
+      double scale = codec.scale;
+      size_t bad = 0;
+      switch (codec.cls) {
+        case NUM_INT8: bad = encode_fixed<int8_t>(src, nElements, scale, dst); break;
+        case NUM_UINT8: bad = encode_fixed<uint8_t>(src, nElements, scale, dst); break;
+        case NUM_INT16: bad = encode_fixed<int16_t>(src, nElements, scale, dst); break;
+        case NUM_UINT16: bad = encode_fixed<uint16_t>(src, nElements, scale, dst); break;
+        case NUM_INT32: bad = encode_fixed<int32_t>(src, nElements, scale, dst); break;
+        case NUM_UINT32: bad = encode_fixed<uint32_t>(src, nElements, scale, dst); break;
+        case NUM_INT64: bad = encode_fixed<int64_t>(src, nElements, scale, dst); break;
+        default: bad = encode_fixed<uint64_t>(src, nElements, scale, dst); break;
+      }
+      if (bad < nElements)
+        mexErrMsgIdAndTxt("msgpack:ext_encode", "ext code %d can't encode %g as %s times %g.", code,
+                          src[bad], num_class_names[codec.cls], codec.scale);
+      RawPacker(pk, MSGPACK_OBJECT_EXT, bytes.size(), code).write(bytes.data(), bytes.size());
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
 void mex_pack_cell(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
   size_t nElements = mxGetNumberOfElements(prhs);
   if (nElements == 3) {
@@ -707,42 +1024,38 @@ void mex_pack_cell(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
     mxArray* ext_code = mxGetCell(prhs, 1);
     mxArray* ext_data = mxGetCell(prhs, 2);
     if (mxIsChar(ext_tag) && (strcmp(mxArrayToString(ext_tag), "MSGPACK_EXT") == 0) &&
-        mxIsNumeric(ext_code) && mxIsScalar(ext_code) &&
-        mxIsUint8(ext_data)) {
-      int8_t code = mxGetScalar(ext_code);
-      if (code != mxGetScalar(ext_code)) {
-        mexErrMsgIdAndTxt("msgpack:invalid_ext_code",
-                          "ext code must be integral in range [-127, 128]");
+        mxIsNumeric(ext_code) && mxIsScalar(ext_code) && ext_data) {
+      int8_t code = 0;
+      if (mxIsUint8(ext_data)) {
+        code = get_ext_code(ext_code);
+        if (code == EXT_CHUNKED)
+          mexErrMsgIdAndTxt("msgpack:invalid_ext_code",
+                            "ext code %d is reserved for chunked containers.", code);
+        uint8_t* ptr = (uint8_t*)mxGetData(ext_data);
+        size_t len = mxGetNumberOfElements(ext_data);
+        RawPacker(pk, MSGPACK_OBJECT_EXT, len, code).write(ptr, len*sizeof(uint8_t));
+        return;
       }
-      uint8_t* ptr = (uint8_t*)mxGetData(ext_data);
-      size_t len = mxGetNumberOfElements(ext_data);
-      msgpack_pack_ext(pk, len, code);
-      msgpack_pack_ext_body(pk, ptr, len*sizeof(uint8_t));
-      return;
+      // Other data needs a registered encoder, or is packed as a plain 1x3 cell (as is any code
+      // that can't be registered).
+      if (read_ext_code(ext_code, &code) && pack_registered_ext(pk, code, ext_data)) return;
     }
   }
-  if (nElements > 1) msgpack_pack_array(pk, nElements);
-  for (size_t i = 0; i < nElements; i++) {
-    mxArray * pm = mxGetCell(prhs, i);
-    pack_mxArray(pk, nrhs, pm);
+  size_t len = pack_chunk_len();
+  if (nElements > len) {
+    // The frame starts a piece every len cells.
+    pack_chunk_marker(pk, nElements, len);
+    push_pack_frame(PACK_FRAME_CELL, prhs, NULL, nElements, len);
+    return;
   }
+  if (nElements > 1) msgpack_pack_array(pk, nElements);
+  push_pack_frame(PACK_FRAME_CELL, prhs, NULL, nElements);
 }
 
 void mex_pack_struct(msgpack_packer *pk, int nrhs, const mxArray *prhs) {
-  int nField = mxGetNumberOfFields(prhs);
+  size_t nField = mxGetNumberOfFields(prhs);
   if (nField > 1) msgpack_pack_map(pk, nField);
-  const char* field_name = NULL;
-  int fieldname_len = 0;
-  int ifield = 0;
-  for (int i = 0; i < nField; i++) {
-    field_name = mxGetFieldNameByNumber(prhs, i);
-    fieldname_len = strlen(field_name);
-    msgpack_pack_str(pk, fieldname_len);
-    msgpack_pack_str_body(pk, field_name, fieldname_len);
-    ifield = mxGetFieldNumber(prhs, field_name);
-    mxArray* pm = mxGetFieldByNumber(prhs, 0, ifield);
-    pack_mxArray(pk, nrhs, pm);
-  }
+  push_pack_frame(PACK_FRAME_STRUCT, prhs, NULL, nField);
 }
 
 void mex_pack(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
@@ -770,8 +1083,7 @@ void mex_pack_raw(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     size_t nElements = mxGetNumberOfElements(prhs[i]);
     size_t sElements = mxGetElementSize(prhs[i]);
     uint8_t *data = (uint8_t*)mxGetData(prhs[i]);
-    msgpack_pack_str(pk, nElements * sElements);
-    msgpack_pack_str_body(pk, data, nElements * sElements);
+    RawPacker(pk, MSGPACK_OBJECT_STR, nElements * sElements).write(data, nElements * sElements);
   }
 
   plhs[0] = mxCreateNumericMatrix(1, buffer->size, mxUINT8_CLASS, mxREAL);
@@ -782,6 +1094,485 @@ void mex_pack_raw(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   msgpack_packer_free(pk);
 }
 
+// Unpack the table variable at data[*offset] (see pack_table_variable). Numeric, logical, char and
+// cell arrays are reshaped in place (no copy); other classes go through MATLAB.
+mxArray* unpack_table_variable(const char* data, size_t size, size_t* offset) {
+  size_t start = *offset, n = 0;
+  msgpack_object obj;
+  vector<mwSize> dims;
+  stream_unpacker.read_header(data, size, offset, &obj, &n);
+  if (obj.type == MSGPACK_OBJECT_ARRAY && n == 2) {
+    stream_unpacker.read_header(data, size, offset, &obj, &n);
+    if (obj.type == MSGPACK_OBJECT_EXT && obj.via.ext.type == EXT_TABLE_SHAPE &&
+        obj.via.ext.size >= 2 * sizeof(uint64_t) && obj.via.ext.size % sizeof(uint64_t) == 0) {
+      dims.resize(obj.via.ext.size / sizeof(uint64_t));
+      for (size_t k = 0; k < dims.size(); k++) {
+        uint64_t dim;
+        memcpy(&dim, obj.via.ext.ptr + k * sizeof(uint64_t), sizeof(uint64_t));  // little-endian
+        dims[k] = dim;
+      }
+    }
+  }
+  if (dims.empty()) *offset = start;
+  mxArray* var = unpack_message(data, size, offset);
+  bool in_place = mxIsNumeric(var) || mxIsLogical(var) || mxIsChar(var) || mxIsCell(var);
+  if (dims.empty()) {
+    // A plain column comes back as a row
+    if (mxGetM(var) != 1 || mxGetNumberOfDimensions(var) != 2) return var;
+    dims.push_back(mxGetN(var));
+    dims.push_back(1);
+  }
+  if (in_place) {
+    size_t nElements = 1;
+    for (size_t k = 0; k < dims.size(); k++) {
+      if (dims[k] && nElements > SIZE_MAX / dims[k]) nElements = SIZE_MAX;
+      else nElements *= dims[k];
+    }
+    if (nElements != mxGetNumberOfElements(var))
+      mexErrMsgIdAndTxt("msgpack:unpack_table_bad_shape",
+                        "Table variable has %zu elements, not the %zu of its size.",
+                        (size_t)mxGetNumberOfElements(var), nElements);
+    mxSetDimensions(var, dims.data(), dims.size());
+    return var;
+  }
+  // string, categorical, datetime
+  mxArray* size_arr = mxCreateNumericMatrix(1, dims.size(), mxDOUBLE_CLASS, mxREAL);
+  for (size_t k = 0; k < dims.size(); k++) mxGetPr(size_arr)[k] = (double)dims[k];
+  mxArray* args[] = {var, size_arr};
+  mxArray* ret = NULL;
+  mexCallMATLAB(1, &ret, 2, args, "reshape");
+  mxDestroyArray(var);
+  mxDestroyArray(size_arr);
+  return ret;
+}
+
+// Unpack a map of column name to column into a MATLAB table. The map is walked here rather than
+// unpacked as a struct, so each variable can get back its size before going to struct2table.
+void mex_unpack_table(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  const char *str = (const char*)mxGetData(prhs[0]);
+  size_t size = mxGetNumberOfElements(prhs[0]);
+
+  if (!prescan_or_error(str, size, 0))
+    mexErrMsgIdAndTxt("msgpack:unpack_error", "Incomplete message.");
+  uint8_t head = (uint8_t)str[0];  // Non-empty, or the pre-scan would have failed
+  if (!((head >= 0x80 && head <= 0x8f) || head == 0xde || head == 0xdf))
+    mexErrMsgIdAndTxt("msgpack:unpack_table_not_map", "Table must be packed as a map of columns.");
+  size_t offset = 0, nvars = 0;
+  msgpack_object obj;
+  stream_unpacker.read_header(str, size, &offset, &obj, &nvars);
+  vector<string> names(nvars);
+  vector<mxArray*> vars(nvars);
+  for (size_t i = 0; i < nvars; i++) {
+    size_t n = 0;
+    stream_unpacker.read_header(str, size, &offset, &obj, &n);
+    if (obj.type != MSGPACK_OBJECT_STR)
+      mexErrMsgIdAndTxt("msgpack:unpack_table_bad_keys", "Table column names must be strings.");
+    names[i].assign(obj.via.str.ptr, obj.via.str.size);
+    vars[i] = unpack_table_variable(str, size, &offset);
+  }
+  mxArray* columns = mex_builder.create_struct(names);
+  for (size_t i = 0; i < nvars; i++) mxSetFieldByNumber(columns, 0, i, vars[i]);
+  mexCallMATLAB(1, plhs, 1, &columns, "struct2table");
+  mxDestroyArray(columns);
+}
+
+// Optional non-negative size argument; Inf means no limit.
+size_t get_size_arg(int nrhs, const mxArray *prhs[], int i, size_t default_val, const char* name) {
+  if (nrhs <= i || mxIsEmpty(prhs[i])) return default_val;
+  if (!mxIsNumeric(prhs[i]) || !mxIsScalar(prhs[i]))
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "%s must be a numeric scalar.", name);
+  double val = mxGetScalar(prhs[i]);
+  if (mxIsInf(val) && val > 0) return SIZE_MAX;
+  // Check the range before casting, since converting NaN or a double past SIZE_MAX is undefined.
+  if (mxIsNaN(val) || val < 0 || val >= (double)SIZE_MAX || val != floor(val))
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "%s must be a non-negative integer.", name);
+  return (size_t)val;
+}
+
+// Background file writers for 'writer_open'/'writer_append'. Appends are packed into the current
+// buffer on the MATLAB thread. Full buffers are queued to a thread that writes them to the file
+// and hands them back for reuse. The queue is bounded, so appends block if the disk falls behind.
+struct AsyncWriter {
+  FILE* file;
+  string path;
+  size_t buffer_bytes;   // Queue the current buffer once it holds this much
+  size_t max_queue;      // Maximum full buffers waiting to be written
+  msgpack_sbuffer* current;
+  std::deque<msgpack_sbuffer*> queue;
+  vector<msgpack_sbuffer*> spare;
+  std::mutex mutex;
+  std::condition_variable cond;  // Signaled whenever queue, busy or closing changes
+  std::thread thread;
+  bool busy;     // Background thread is writing a buffer
+  bool closing;
+  std::atomic<int> error;  // errno of the first failed write, also read without the mutex
+  // Set while an append is packing. If still set on the next call, that append was aborted by an
+  // error and current is rolled back to mark.
+  bool packing;
+  size_t mark;
+};
+
+// Writers by handle - 1. A closed writer's slot stays NULL, so a stale handle never reaches a
+// writer opened later.
+vector<AsyncWriter*> writers;
+
+bool any_writer_open(void) {
+  return std::find_if(writers.begin(), writers.end(), [](AsyncWriter* v) {return v != NULL;}) !=
+         writers.end();
+}
+
+void writer_thread(AsyncWriter* w) {
+  std::unique_lock<std::mutex> lock(w->mutex);
+  while (true) {
+    while (w->queue.empty() && !w->closing) w->cond.wait(lock);
+    if (w->queue.empty()) break;  // closing and drained
+    msgpack_sbuffer* buf = w->queue.front();
+    w->queue.pop_front();
+    w->busy = true;
+    lock.unlock();
+    int error = 0;
+    if (!w->error && fwrite(buf->data, 1, buf->size, w->file) != buf->size) error = errno;
+    lock.lock();
+    if (error && !w->error) w->error = error;
+    msgpack_sbuffer_clear(buf);
+    w->spare.push_back(buf);
+    w->busy = false;
+    w->cond.notify_all();
+  }
+}
+
+// Drop the partly packed variable of an append that was aborted by an error.
+void writer_rollback(AsyncWriter* w) {
+  if (w->packing) {
+    w->current->size = w->mark;
+    w->packing = false;
+  }
+}
+
+AsyncWriter* get_writer(int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1 || !mxIsNumeric(prhs[0]) || !mxIsScalar(prhs[0]))
+    mexErrMsgIdAndTxt("msgpack:writer_bad_handle", "Need a writer handle.");
+  double h = mxGetScalar(prhs[0]);
+  if (h < 1 || h > writers.size() || h != (size_t)h || writers[(size_t)h - 1] == NULL)
+    mexErrMsgIdAndTxt("msgpack:writer_bad_handle", "No open writer with handle %g.", h);
+  AsyncWriter* w = writers[(size_t)h - 1];
+  writer_rollback(w);
+  return w;
+}
+
+void writer_check_error(AsyncWriter* w) {
+  if (w->error)
+    mexErrMsgIdAndTxt("msgpack:writer_io_error", "Writing %s failed: %s", w->path.c_str(),
+                      strerror(w->error));
+}
+
+// Hand the current buffer to the background thread, waiting for room in the queue.
+void writer_enqueue(AsyncWriter* w) {
+  std::unique_lock<std::mutex> lock(w->mutex);
+  while (w->queue.size() >= w->max_queue && !w->error) w->cond.wait(lock);
+  w->queue.push_back(w->current);
+  if (w->spare.empty()) {
+    w->current = msgpack_sbuffer_new();
+  } else {
+    w->current = w->spare.back();
+    w->spare.pop_back();
+  }
+  w->cond.notify_all();
+}
+
+// Write out everything appended so far and wait for it to reach the OS.
+void writer_flush(AsyncWriter* w) {
+  if (w->current->size) writer_enqueue(w);
+  std::unique_lock<std::mutex> lock(w->mutex);
+  while (!w->queue.empty() || w->busy) w->cond.wait(lock);
+  if (!w->error && fflush(w->file) != 0) w->error = errno;
+}
+
+void writer_close(AsyncWriter* w) {
+  writer_flush(w);
+  {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    w->closing = true;
+    w->cond.notify_all();
+  }
+  w->thread.join();
+  if (fclose(w->file) != 0 && !w->error) w->error = errno;
+  msgpack_sbuffer_free(w->current);
+  for (size_t i = 0; i < w->spare.size(); i++) msgpack_sbuffer_free(w->spare[i]);
+  for (size_t i = 0; i < writers.size(); i++) {
+    if (writers[i] == w) writers[i] = NULL;
+  }
+  if (!any_writer_open()) mexUnlock();
+}
+
+void writer_close_all(void) {
+  for (size_t i = 0; i < writers.size(); i++) {
+    AsyncWriter* w = writers[i];
+    if (w) {
+      writer_rollback(w);
+      writer_close(w);
+      delete w;
+    }
+  }
+}
+
+// h = msgpack('writer_open', path[, buffer_bytes[, max_queue]])
+void mex_writer_open(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1 || !mxIsChar(prhs[0]))
+    mexErrMsgIdAndTxt("msgpack:writer_bad_path", "Need a file path.");
+  size_t buffer_bytes = get_size_arg(nrhs, prhs, 1, 4 << 20, "buffer_bytes");
+  size_t max_queue = get_size_arg(nrhs, prhs, 2, 4, "max_queue");
+  if (max_queue < 1)
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "max_queue must be at least 1.");
+  char* path = mxArrayToString(prhs[0]);
+  FILE* file = fopen(path, "wb");
+  if (!file)
+    mexErrMsgIdAndTxt("msgpack:writer_io_error", "Can't open %s: %s", path, strerror(errno));
+
+  AsyncWriter* w = new AsyncWriter();
+  w->file = file;
+  w->path = path;
+  w->buffer_bytes = buffer_bytes;
+  w->max_queue = max_queue;
+  w->current = msgpack_sbuffer_new();
+  w->busy = w->closing = w->packing = false;
+  w->error = 0;
+  w->mark = 0;
+  w->thread = std::thread(writer_thread, w);
+  mxFree(path);
+  // Keep the mex file loaded while a thread is running.
+  if (!any_writer_open()) mexLock();
+  writers.push_back(w);
+  plhs[0] = mxCreateDoubleScalar(writers.size());
+}
+
+// msgpack('writer_append', h, var1, var2, ...)
+void mex_writer_append(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  AsyncWriter* w = get_writer(nrhs, prhs);
+  writer_check_error(w);
+  msgpack_packer pk;
+  for (int i = 1; i < nrhs; i++) {
+    msgpack_packer_init(&pk, w->current, msgpack_sbuffer_write);
+    w->mark = w->current->size;
+    w->packing = true;
+    pack_mxArray(&pk, nrhs - 1, prhs[i]);
+    w->packing = false;
+    if (w->current->size >= w->buffer_bytes) writer_enqueue(w);
+  }
+}
+
+void mex_writer_flush(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  AsyncWriter* w = get_writer(nrhs, prhs);
+  writer_flush(w);
+  writer_check_error(w);
+}
+
+void mex_writer_close(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  AsyncWriter* w = get_writer(nrhs, prhs);
+  writer_close(w);
+  int error = w->error;
+  string path = w->path;
+  delete w;
+  if (error)
+    mexErrMsgIdAndTxt("msgpack:writer_io_error", "Writing %s failed: %s", path.c_str(),
+                      strerror(error));
+}
+
+// Shared-memory rings for 'ring_open'/'ring_pack'/'ring_unpack'. See msgpack_ring.h for the
+// layout. Messages are packed straight into ring slots and unpacked straight out of them.
+struct MappedRing {
+  msgpack_ring* ring;
+  size_t map_size;
+  uint64_t capacity;  // As checked against map_size when the ring was opened
+  string name;
+};
+
+vector<MappedRing> rings;
+
+// The ring whose oldest record ring_unpack is unpacking. Errors raised through MexBuilder release
+// the record before they return to MATLAB; any other error leaves it to the start of the next call.
+// Either way a record that can't be unpacked is dropped rather than stalling the ring.
+msgpack_ring* unpacking_ring = NULL;
+
+void ring_release_unpacking() {
+  if (unpacking_ring) msgpack_ring_release(unpacking_ring);
+  unpacking_ring = NULL;
+}
+
+MappedRing& get_ring(int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1 || !mxIsNumeric(prhs[0]) || !mxIsScalar(prhs[0]))
+    mexErrMsgIdAndTxt("msgpack:ring_bad_handle", "Need a ring handle.");
+  double h = mxGetScalar(prhs[0]);
+  if (h < 1 || h > rings.size() || h != (size_t)h || rings[(size_t)h - 1].ring == NULL)
+    mexErrMsgIdAndTxt("msgpack:ring_bad_handle", "No open ring with handle %g.", h);
+  MappedRing& mapped = rings[(size_t)h - 1];
+  // The header is shared with the other process; offsets are only safe with the checked capacity.
+  if (mapped.ring->capacity != mapped.capacity)
+    mexErrMsgIdAndTxt("msgpack:ring_not_ready", "Ring %s has a corrupted header.",
+                      mapped.name.c_str());
+  return mapped;
+}
+
+string ring_shm_name(const mxArray* arg) {
+  if (!mxIsChar(arg))
+    mexErrMsgIdAndTxt("msgpack:ring_bad_name", "Ring name must be a char array.");
+  char* name = mxArrayToString(arg);
+  string ret = (name[0] == '/') ? name : string("/") + name;
+  mxFree(name);
+  return ret;
+}
+
+// Packer callback writing into a fixed-size region. Keeps counting past the end so the caller
+// learns the full message size.
+struct BoundedWriter {
+  char* ptr;
+  size_t capacity;
+  size_t size;
+};
+
+int bounded_write(void* data, const char* buf, size_t len) {
+  BoundedWriter* bw = (BoundedWriter*)data;
+  if (bw->size + len <= bw->capacity) memcpy(bw->ptr + bw->size, buf, len);
+  bw->size += len;
+  return 0;
+}
+
+// h = msgpack('ring_open', name[, capacity_bytes])
+// Creates the shared memory object if it doesn't exist yet, otherwise attaches to it.
+void mex_ring_open(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1)
+    mexErrMsgIdAndTxt("msgpack:ring_bad_name", "Need a ring name.");
+  string name = ring_shm_name(prhs[0]);
+  size_t capacity = get_size_arg(nrhs, prhs, 1, 16 << 20, "capacity_bytes");
+  capacity = (capacity + 7) & ~(size_t)7;
+  if (capacity < 64)
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "capacity_bytes must be at least 64.");
+
+  bool created = true;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  }
+  if (fd < 0)
+    mexErrMsgIdAndTxt("msgpack:ring_io_error", "shm_open %s: %s", name.c_str(), strerror(errno));
+  size_t map_size = sizeof(msgpack_ring) + capacity;
+  if (created) {
+    if (ftruncate(fd, map_size) != 0) {
+      int err = errno;
+      close(fd);
+      shm_unlink(name.c_str());
+      mexErrMsgIdAndTxt("msgpack:ring_io_error", "ftruncate %s: %s", name.c_str(), strerror(err));
+    }
+  } else {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(msgpack_ring)) {
+      close(fd);
+      mexErrMsgIdAndTxt("msgpack:ring_not_ready", "Ring %s is not initialized yet.", name.c_str());
+    }
+    map_size = st.st_size;
+  }
+  void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    mexErrMsgIdAndTxt("msgpack:ring_io_error", "mmap %s: %s", name.c_str(), strerror(errno));
+  msgpack_ring* ring = (msgpack_ring*)addr;
+  if (created) {
+    msgpack_ring_init(ring, capacity);
+  } else if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != MSGPACK_RING_MAGIC ||
+             ring->version != MSGPACK_RING_VERSION || ring->capacity < 64 ||
+             ring->capacity % 8 || ring->capacity > map_size - sizeof(msgpack_ring)) {
+    munmap(addr, map_size);
+    mexErrMsgIdAndTxt("msgpack:ring_not_ready", "%s is not an initialized msgpack ring.",
+                      name.c_str());
+  }
+  MappedRing mapped = {ring, map_size, ring->capacity, name};
+  rings.push_back(mapped);
+  plhs[0] = mxCreateDoubleScalar(rings.size());
+}
+
+// n = msgpack('ring_pack', h, var1, var2, ...)
+// Packs each variable into its own ring record. Stops at the first one that doesn't fit and
+// returns how many were written.
+void mex_ring_pack(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  msgpack_ring* ring = get_ring(nrhs, prhs).ring;
+  msgpack_packer pk;
+  int npacked = 0;
+  for (int i = 1; i < nrhs; i++) {
+    // Pack in place at the tail. Only if the message runs past the end of the data area (or the
+    // free space) is it packed a second time, after wrapping.
+    BoundedWriter bw = {NULL, (size_t)msgpack_ring_writable(ring), 0};
+    bw.ptr = msgpack_ring_data(ring) + ring->tail % ring->capacity + MSGPACK_RING_RECORD_HEADER;
+    msgpack_packer_init(&pk, &bw, bounded_write);
+    pack_mxArray(&pk, nrhs - 1, prhs[i]);
+    if (bw.size >= MSGPACK_RING_WRAP || msgpack_ring_record_size(bw.size) > ring->capacity)
+      mexErrMsgIdAndTxt("msgpack:ring_message_too_large",
+                        "Message of %zu bytes can never fit in the ring.", bw.size);
+    if (bw.size > bw.capacity) {
+      bw.ptr = msgpack_ring_reserve(ring, bw.size);
+      if (!bw.ptr) break;
+      bw.capacity = bw.size;
+      bw.size = 0;
+      msgpack_packer_init(&pk, &bw, bounded_write);
+      pack_mxArray(&pk, nrhs - 1, prhs[i]);
+    }
+    msgpack_ring_commit(ring, bw.size);
+    npacked++;
+  }
+  plhs[0] = mxCreateDoubleScalar(npacked);
+}
+
+// objs = msgpack('ring_unpack', h[, max_count])
+// Unpacks up to max_count waiting messages directly from shared memory. Returns a 1xN cell.
+void mex_ring_unpack(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  msgpack_ring* ring = get_ring(nrhs, prhs).ring;
+  size_t max_count = get_size_arg(nrhs, prhs, 1, SIZE_MAX, "max_count");
+  vector<mxArray *> cells;
+  uint32_t len = 0;
+  const char* payload = NULL;
+  while (cells.size() < max_count && (payload = msgpack_ring_peek(ring, &len)) != NULL) {
+    // Drop a bad record before raising so the ring doesn't stall on it.
+    unpacking_ring = ring;
+    if (len == MSGPACK_RING_WRAP) {
+      ring_release_unpacking();
+      mexErrMsgIdAndTxt("msgpack:unpack_error",
+                        "Malformed ring record; dropped everything written so far.");
+    }
+    if (!prescan_or_error(payload, len, 0)) {
+      ring_release_unpacking();
+      mexErrMsgIdAndTxt("msgpack:unpack_error", "unpack error in ring record");
+    }
+    size_t offset = 0;
+    cells.push_back(unpack_message(payload, len, &offset));
+    ring_release_unpacking();
+  }
+  plhs[0] = mxCreateCellMatrix(1, cells.size());
+  for (size_t i = 0; i < cells.size(); i++)
+    mxSetCell(plhs[0], i, cells[i]);
+}
+
+void mex_ring_close(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  MappedRing& mapped = get_ring(nrhs, prhs);
+  munmap(mapped.ring, mapped.map_size);
+  mapped.ring = NULL;
+}
+
+void ring_close_all() {
+  ring_release_unpacking();
+  for (size_t i = 0; i < rings.size(); i++)
+    if (rings[i].ring) munmap(rings[i].ring, rings[i].map_size);
+  rings.clear();
+}
+
+// msgpack('ring_unlink', name): remove the shared memory object. Open mappings stay valid.
+void mex_ring_unlink(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1)
+    mexErrMsgIdAndTxt("msgpack:ring_bad_name", "Need a ring name.");
+  string name = ring_shm_name(prhs[0]);
+  if (shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+    mexErrMsgIdAndTxt("msgpack:ring_io_error", "shm_unlink %s: %s", name.c_str(), strerror(errno));
+}
+
 void mex_unpacker_set_cell(mxArray *plhs, int nlhs, mxArrayRes *res) {
   if (nlhs > 0)
     mex_unpacker_set_cell(plhs, nlhs-1, res->next);
@@ -814,7 +1605,7 @@ void mex_unpacker(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   msgpack_unpacker_init(&pac, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);
 
   const char *str = (const char*)mxGetData(prhs[0]);
-  int size = mxGetM(prhs[0]) * mxGetN(prhs[0]);
+  size_t size = mxGetNumberOfElements(prhs[0]);
   if (size) {
     /* feeds the buffer */
     msgpack_unpacker_reserve_buffer(&pac, size);
@@ -837,34 +1628,394 @@ void mex_unpacker(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   mxArrayRes_free(ret);
 }
 
-vector<mxArray *> cells;
+// stats = msgpack('prescan', buf[, offset])
+// Reports the size and shape of the message at the 0-based byte offset without unpacking it.
+void mex_prescan(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1 || !mxIsUint8(prhs[0]))
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "Need a uint8 buffer.");
+  const char *str = (const char*)mxGetData(prhs[0]);
+  size_t size = mxGetNumberOfElements(prhs[0]);
+  size_t offset = get_size_arg(nrhs, prhs, 1, 0, "offset");
+  if (offset > size)
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "offset is past the end of the buffer.");
+  PrescanStats stats;
+  PrescanResult result = prescan_message(str + offset, size - offset, limits, &stats);
+  const char* status_names[] = {"ok", "incomplete", "malformed", "limit"};
+  const char* field_names[] = {"status", "limit", "bytes", "objects", "depth",
+                               "max_container_len", "max_str_len", "projected_bytes"};
+  plhs[0] = mxCreateStructMatrix(1, 1, 8, field_names);
+  mxSetFieldByNumber(plhs[0], 0, 0, mxCreateString(status_names[result]));
+  mxSetFieldByNumber(plhs[0], 0, 1, mxCreateString(stats.limit ? stats.limit : ""));
+  size_t values[] = {stats.bytes, stats.objects, stats.depth, stats.max_container_len,
+                     stats.max_str_len, stats.projected_bytes};
+  for (int i = 0; i < 6; i++)
+    mxSetFieldByNumber(plhs[0], 0, i + 2, mxCreateDoubleScalar(values[i]));
+}
+
+// [objs, next_offset] = msgpack('unpacker', buf, start_offset, max_count, max_bytes)
+// Unpacks consecutive messages straight from buf, starting at the 0-based byte offset
+// start_offset. Stops after max_count messages, once at least max_bytes have been consumed, or at
+// an incomplete trailing message, and returns the offset to resume from.
 void mex_unpacker_std(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
-  int npack = 0;
-  /* Init deserialize using msgpack_unpacker */
-  msgpack_unpacker pac;
-  msgpack_unpacker_init(&pac, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);
+  const char *str = (const char*)mxGetData(prhs[0]);
+  size_t size = mxGetNumberOfElements(prhs[0]);
+  size_t start = get_size_arg(nrhs, prhs, 1, 0, "start_offset");
+  size_t max_count = get_size_arg(nrhs, prhs, 2, SIZE_MAX, "max_count");
+  size_t max_bytes = get_size_arg(nrhs, prhs, 3, SIZE_MAX, "max_bytes");
+  if (start > size)
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "start_offset is past the end of the buffer.");
+
+  vector<mxArray *> cells;
+  size_t offset = start;
+  while (cells.size() < max_count && offset < size && offset - start < max_bytes) {
+    if (!prescan_or_error(str, size, offset)) break;  // Partial message. Resume here with more data.
+    cells.push_back(unpack_message(str, size, &offset));
+  }
+
+  /* set cell for output */
+  plhs[0] = mxCreateCellMatrix(1, cells.size());
+  for (size_t i = 0; i < cells.size(); i++)
+    mxSetCell(plhs[0], i, cells[i]);
+  if (nlhs > 1)
+    plhs[1] = mxCreateDoubleScalar(offset);
+}
+
+// Schema-driven unpacking. A prototype value is compiled once into a tree of SchemaNodes; messages
+// are then decoded straight into outputs of the prototype's classes, without type inference.
+enum SchemaKind {SCHEMA_NUMERIC, SCHEMA_LOGICAL, SCHEMA_CHAR, SCHEMA_STRUCT, SCHEMA_ANY};
+
+struct SchemaNode {
+  SchemaKind kind;
+  mxClassID classid;
+  bool scalar;       // A single value (or 1x1 struct), otherwise a 1xN row (or struct array)
+  size_t numel;      // Required N for rows, 0 for any length
+  string path;       // e.g. "pos.x", for error messages
+  vector<string> field_names;
+  vector<SchemaNode> fields;
+};
+
+vector<SchemaNode> schemas;
+
+void compile_schema(const mxArray* proto, SchemaNode& node, const string& path) {
+  unsigned int classid = mxGetClassID(proto);
+  size_t nElements = mxGetNumberOfElements(proto);
+  node.classid = (mxClassID)classid;
+  node.scalar = (nElements == 1);
+  node.numel = (nElements > 1) ? nElements : 0;
+  node.path = path.empty() ? "<root>" : path;
+  if (numeric_class_size(classid) > 0) {
+    node.kind = SCHEMA_NUMERIC;
+  } else if (classid == mxLOGICAL_CLASS) {
+    node.kind = SCHEMA_LOGICAL;
+  } else if (classid == mxCHAR_CLASS) {
+    node.kind = SCHEMA_CHAR;
+  } else if (classid == mxCELL_CLASS) {
+    node.kind = SCHEMA_ANY;
+  } else if (classid == mxSTRUCT_CLASS) {
+    // A struct array of two or more elements means an array of maps of any length, with the
+    // first element as the prototype for all of them.
+    node.kind = SCHEMA_STRUCT;
+    node.numel = 0;
+    int nField = mxGetNumberOfFields(proto);
+    node.field_names.resize(nField);
+    node.fields.resize(nField);
+    for (int i = 0; i < nField; i++) {
+      node.field_names[i] = mxGetFieldNameByNumber(proto, i);
+      string field_path = path.empty() ? node.field_names[i] : path + "." + node.field_names[i];
+      mxArray* field_proto = (nElements > 0) ? mxGetFieldByNumber(proto, 0, i) : NULL;
+      if (field_proto == NULL) {
+        mexErrMsgIdAndTxt("msgpack:schema_bad_prototype",
+                          "Field %s has no prototype value.", field_path.c_str());
+      }
+      compile_schema(field_proto, node.fields[i], field_path);
+    }
+  } else {
+    mexErrMsgIdAndTxt("msgpack:schema_bad_prototype",
+                      "%s: can't unpack to class %s with a schema.", node.path.c_str(),
+                      mxGetClassName(proto));
+  }
+}
+
+template <typename T>
+bool schema_store_int(T* dst, const msgpack_object& obj) {
+  switch (obj.type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+      if (obj.via.u64 > (uint64_t)std::numeric_limits<T>::max()) return false;
+      *dst = (T)obj.via.u64;
+      return true;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+      if (!std::numeric_limits<T>::is_signed ||
+          obj.via.i64 < (int64_t)std::numeric_limits<T>::min()) return false;
+      *dst = (T)obj.via.i64;
+      return true;
+    case MSGPACK_OBJECT_NIL:
+      *dst = 0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+template <typename T>
+bool schema_store_float(T* dst, const msgpack_object& obj) {
+  switch (obj.type) {
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+      *dst = (T)obj.via.u64;
+      return true;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+      *dst = (T)obj.via.i64;
+      return true;
+    case MSGPACK_OBJECT_FLOAT32:
+    case MSGPACK_OBJECT_FLOAT64:
+      *dst = (T)obj.via.f64;
+      return true;
+    case MSGPACK_OBJECT_NIL:
+      *dst = (flags.unpack_nil == UNPACK_NIL_NAN) ? (T)mxGetNaN() : 0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Store one msgpack scalar at element i of a numeric or logical array's data.
+bool schema_store(mxClassID classid, void* data, size_t i, const msgpack_object& obj) {
+  switch (classid) {
+    case mxDOUBLE_CLASS: return schema_store_float((double*)data + i, obj);
+    case mxSINGLE_CLASS: return schema_store_float((float*)data + i, obj);
+    case mxINT8_CLASS: return schema_store_int((int8_t*)data + i, obj);
+    case mxUINT8_CLASS: return schema_store_int((uint8_t*)data + i, obj);
+    case mxINT16_CLASS: return schema_store_int((int16_t*)data + i, obj);
+    case mxUINT16_CLASS: return schema_store_int((uint16_t*)data + i, obj);
+    case mxINT32_CLASS: return schema_store_int((int32_t*)data + i, obj);
+    case mxUINT32_CLASS: return schema_store_int((uint32_t*)data + i, obj);
+    case mxINT64_CLASS: return schema_store_int((int64_t*)data + i, obj);
+    case mxUINT64_CLASS: return schema_store_int((uint64_t*)data + i, obj);
+    case mxLOGICAL_CLASS:
+      if (obj.type == MSGPACK_OBJECT_BOOLEAN) ((bool*)data)[i] = obj.via.boolean;
+      else if (obj.type == MSGPACK_OBJECT_NIL) ((bool*)data)[i] = false;
+      else return false;
+      return true;
+    default:
+      return false;
+  }
+}
+
+void schema_mismatch(const SchemaNode& node, const msgpack_object& obj) {
+  mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: expected %s, got msgpack object type %d.",
+                    node.path.c_str(), (node.kind == SCHEMA_STRUCT) ? "struct" :
+                    (node.kind == SCHEMA_CHAR) ? "char" :
+                    (node.kind == SCHEMA_LOGICAL) ? "logical" : "numeric", obj.type);
+}
+
+mxArray* unpack_schema_node(const SchemaNode& node, const msgpack_object& obj);
+
+// Fill element `index` of a preallocated struct array from a map.
+void unpack_schema_fields(const SchemaNode& node, const msgpack_object& obj, mxArray* ret,
+                          size_t index) {
+  if (obj.type != MSGPACK_OBJECT_MAP) schema_mismatch(node, obj);
+  size_t nfields = node.fields.size();
+  vector<bool> seen(nfields, false);
+  for (size_t i = 0; i < obj.via.map.size; i++) {
+    const msgpack_object_kv& kv = obj.via.map.ptr[i];
+    if (kv.key.type != MSGPACK_OBJECT_STR) {
+      mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: map has a non-str key.",
+                        node.path.c_str());
+    }
+    size_t ifield = 0;
+    while (ifield < nfields &&
+           (node.field_names[ifield].size() != kv.key.via.str.size ||
+            memcmp(node.field_names[ifield].data(), kv.key.via.str.ptr, kv.key.via.str.size) != 0))
+      ifield++;
+    if (ifield == nfields) {
+      mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: unexpected key '%.*s'.",
+                        node.path.c_str(), (int)kv.key.via.str.size, kv.key.via.str.ptr);
+    }
+    if (seen[ifield]) {
+      mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: duplicate key '%.*s'.",
+                        node.path.c_str(), (int)kv.key.via.str.size, kv.key.via.str.ptr);
+    }
+    seen[ifield] = true;
+    mxSetFieldByNumber(ret, index, ifield, unpack_schema_node(node.fields[ifield], kv.val));
+  }
+  for (size_t i = 0; i < nfields; i++) {
+    if (!seen[i]) {
+      mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: missing.", node.fields[i].path.c_str());
+    }
+  }
+}
+
+mxArray* unpack_schema_node(const SchemaNode& node, const msgpack_object& obj) {
+  mxArray* ret = NULL;
+  if (node.kind == SCHEMA_ANY) return unpack_obj(obj);
+  // A chunked str or bin is joined by the generic unpacker and then checked.
+  uint64_t total = 0;
+  bool chunked = is_chunked(obj, &total);
+  if (chunked && obj.via.array.ptr[1].type != MSGPACK_OBJECT_ARRAY) {
+    mxArray* joined = unpack_obj(obj);
+    if ((node.kind == SCHEMA_CHAR && mxIsChar(joined)) ||
+        (node.kind == SCHEMA_NUMERIC && node.classid == mxUINT8_CLASS && !node.scalar &&
+         mxIsUint8(joined) && (!node.numel || mxGetNumberOfElements(joined) == node.numel)))
+      return joined;
+    mxDestroyArray(joined);
+    schema_mismatch(node, obj);
+  }
+
+  if (node.kind == SCHEMA_CHAR) {
+    if (obj.type == MSGPACK_OBJECT_STR)
+      return mxCreateCharFromUTF8(obj.via.str.ptr, obj.via.str.size);
+    if (obj.type == MSGPACK_OBJECT_NIL)
+      return mxCreateCharFromUTF8(NULL, 0);
+    schema_mismatch(node, obj);
+  }
+
+  if (obj.type == MSGPACK_OBJECT_BIN && node.kind == SCHEMA_NUMERIC &&
+      node.classid == mxUINT8_CLASS && !node.scalar) {
+    if (node.numel && obj.via.bin.size != node.numel) schema_mismatch(node, obj);
+    mxArray* ret = mxCreateNumericMatrix(1, obj.via.bin.size, mxUINT8_CLASS, mxREAL);
+    memcpy(mxGetData(ret), obj.via.bin.ptr, obj.via.bin.size);
+    return ret;
+  }
+
+  // Numeric, logical and struct values may be a single object or an array of them, which may be
+  // chunked.
+  const msgpack_object* elems = &obj;
+  size_t nElements = 1;
+  ChunkedElems chunks = {NULL, 0};
+  if (chunked) {
+    if (!chunked_array_elems(obj.via.array.ptr + 1, obj.via.array.size - 1, total, &chunks))
+      mexErrMsgIdAndTxt("msgpack:unpack_error", "Malformed chunked container.");
+    nElements = total;
+  } else if (obj.type == MSGPACK_OBJECT_ARRAY) {
+    elems = obj.via.array.ptr;
+    nElements = obj.via.array.size;
+  } else if (obj.type == MSGPACK_OBJECT_NIL && !node.scalar && node.kind != SCHEMA_STRUCT) {
+    nElements = 0;
+  }
+  if ((node.scalar && nElements != 1) || (node.numel && nElements != node.numel)) {
+    mexErrMsgIdAndTxt("msgpack:schema_mismatch", "%s: expected %zu element(s), got %zu.",
+                      node.path.c_str(), node.scalar ? (size_t)1 : node.numel, nElements);
+  }
+
+  if (node.kind == SCHEMA_STRUCT) {
+    vector<const char*> names(node.field_names.size());
+    for (size_t i = 0; i < names.size(); i++) names[i] = node.field_names[i].c_str();
+    ret = mxCreateStructMatrix(1, nElements, names.size(), names.data());
+    for (size_t i = 0; i < nElements; i++)
+      unpack_schema_fields(node, chunked ? chunks[i] : elems[i], ret, i);
+    return ret;
+  }
+
+  if (node.kind == SCHEMA_LOGICAL)
+    ret = mxCreateLogicalMatrix(1, nElements);
+  else
+    ret = mxCreateNumericMatrix(1, nElements, node.classid, mxREAL);
+  void* data = mxGetData(ret);
+  for (size_t i = 0; i < nElements; i++) {
+    const msgpack_object& elem = chunked ? chunks[i] : elems[i];
+    if (!schema_store(node.classid, data, i, elem)) {
+      mexErrMsgIdAndTxt("msgpack:schema_mismatch",
+                        "%s(%zu): can't store msgpack object type %d in %s.", node.path.c_str(),
+                        i + 1, elem.type, mxGetClassName(ret));
+    }
+  }
+  return ret;
+}
 
+void mex_register_schema(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1)
+    mexErrMsgIdAndTxt("msgpack:schema_bad_prototype", "Need a prototype value.");
+  SchemaNode node;
+  compile_schema(prhs[0], node, "");
+  schemas.push_back(node);
+  plhs[0] = mxCreateDoubleScalar(schemas.size());
+}
+
+void mex_unpack_schema(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 2 || !mxIsNumeric(prhs[1]) || !mxIsScalar(prhs[1]))
+    mexErrMsgIdAndTxt("msgpack:schema_bad_id", "Usage: msgpack('unpack_schema', msg, schema_id)");
+  double id = mxGetScalar(prhs[1]);
+  if (id < 1 || id > schemas.size() || id != (size_t)id)
+    mexErrMsgIdAndTxt("msgpack:schema_bad_id", "No schema with id %g.", id);
   const char *str = (const char*)mxGetData(prhs[0]);
-  int size = mxGetM(prhs[0]) * mxGetN(prhs[0]);
-  if (size) {
-    /* feeds the buffer */
-    msgpack_unpacker_reserve_buffer(&pac, size);
-    memcpy(msgpack_unpacker_buffer(&pac), str, size);
-    msgpack_unpacker_buffer_consumed(&pac, size);
+  size_t size = mxGetNumberOfElements(prhs[0]);
+
+  if (!prescan_or_error(str, size, 0))
+    mexErrMsgIdAndTxt("msgpack:unpack_error", "Incomplete message.");
+  // The message is read into an object tree first and then checked against the schema, so this
+  // costs as much as a generic unpack plus the checks. What it saves is the type inference and
+  // the conversions of the generic path: values are stored straight into the preallocated outputs.
+  size_t offset = 0;
+  plhs[0] = unpack_schema_node(schemas[(size_t)id - 1], parse_tree(str, size, &offset));
+  free_tree();
+}
 
-    /* start streaming deserialization */
-    msgpack_unpacked msg;
-    msgpack_unpacked_init(&msg);
-    for (;msgpack_unpacker_next(&pac, &msg); npack++) {
-      /* prints the deserialized object. */
-      msgpack_object obj = msg.data;
-      cells.push_back(unpack_obj(obj));
+// Look up a numeric class by MATLAB class name.
+bool parse_num_class(const char* name, NumClass* cls) {
+  for (size_t i = NUM_DOUBLE; i <= NUM_UINT64; i++) {
+    if (strcmp(name, num_class_names[i]) == 0) {
+      *cls = (NumClass)i;
+      return true;
     }
-    /* set cell for output */
-    plhs[0] = mxCreateCellMatrix(1, npack);
-    for (size_t i = 0; i < cells.size(); i++)
-      mxSetCell(plhs[0], i, cells[i]);
-    cells.clear();
+  }
+  return false;
+}
+
+// msgpack('register_ext', code, class)         - packed elements of a numeric class
+// msgpack('register_ext', code, 'bitset')      - bits to logical
+// msgpack('register_ext', code, 'fixed', class, scale) - integers of class times scale to double
+void mex_register_ext(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 2 || !mxIsChar(prhs[1]))
+    mexErrMsgIdAndTxt("msgpack:bad_argument",
+                      "Usage: msgpack('register_ext', code, kind[, class, scale])");
+  int8_t code = get_ext_code(prhs[0]);
+  if (code == EXT_CHUNKED)
+    mexErrMsgIdAndTxt("msgpack:invalid_ext_code", "ext code %d marks chunked containers.", code);
+  char* kind = mxArrayToString(prhs[1]);
+  ExtCodec codec = {EXT_KIND_TYPED, NUM_UINT8, 1};
+  if (strcmp(kind, "bitset") == 0) {
+    codec.kind = EXT_KIND_BITSET;
+  } else if (strcmp(kind, "fixed") == 0) {
+    codec.kind = EXT_KIND_FIXED;
+    char* classname = (nrhs > 2 && mxIsChar(prhs[2])) ? mxArrayToString(prhs[2]) : NULL;
+    if (!classname || !parse_num_class(classname, &codec.cls) || codec.cls == NUM_DOUBLE ||
+        codec.cls == NUM_SINGLE)
+      mexErrMsgIdAndTxt("msgpack:bad_argument", "fixed needs an integer class.");
+    mxFree(classname);
+    codec.scale = (nrhs > 3 && mxIsNumeric(prhs[3]) && mxIsScalar(prhs[3]))
+                  ? mxGetScalar(prhs[3]) : 0;
+    if (!isfinite(codec.scale) || codec.scale == 0)
+      mexErrMsgIdAndTxt("msgpack:bad_argument", "fixed needs a finite, non-zero scale.");
+  } else if (!parse_num_class(kind, &codec.cls)) {
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "Unknown ext kind %s.", kind);
+  }
+  mxFree(kind);
+  ext_codecs[(uint8_t)code] = codec;
+}
+
+// msgpack('unregister_ext', code): unpack code as {code, bytes} again.
+void mex_unregister_ext(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  if (nrhs < 1)
+    mexErrMsgIdAndTxt("msgpack:bad_argument", "Usage: msgpack('unregister_ext', code)");
+  ext_codecs[(uint8_t)get_ext_code(prhs[0])].kind = EXT_KIND_NONE;
+}
+
+// exts = msgpack('list_ext'): a struct array of the registered codes in ascending order.
+void mex_list_ext(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+  vector<int> codes;
+  for (int code = -128; code < 128; code++) {
+    if (ext_codecs[(uint8_t)code].kind != EXT_KIND_NONE) codes.push_back(code);
+  }
+  const char* field_names[] = {"code", "kind", "class", "scale"};
+  plhs[0] = mxCreateStructMatrix(1, codes.size(), 4, field_names);
+  for (size_t i = 0; i < codes.size(); i++) {
+    const ExtCodec& codec = ext_codecs[(uint8_t)codes[i]];
+    bool has_class = (codec.kind == EXT_KIND_TYPED || codec.kind == EXT_KIND_FIXED);
+    mxSetFieldByNumber(plhs[0], i, 0, mxCreateDoubleScalar(codes[i]));
+    mxSetFieldByNumber(plhs[0], i, 1, mxCreateString(ext_kind_names[codec.kind]));
+    mxSetFieldByNumber(plhs[0], i, 2, mxCreateString(has_class ? num_class_names[codec.cls] : ""));
+    mxSetFieldByNumber(plhs[0], i, 3, (codec.kind == EXT_KIND_FIXED)
+                                      ? mxCreateDoubleScalar(codec.scale)
+                                      : mxCreateDoubleMatrix(0, 0, mxREAL));
   }
 }
 
@@ -881,20 +2032,8 @@ void split_string(vector<string>& result, const string& str, char delim=' ') {
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
   static bool init = false;
-  /* Init unpack functions Map */
+  /* Init pack functions Map */
   if (!init) {
-    unPackMap[MSGPACK_OBJECT_NIL] = mex_unpack_nil;
-    unPackMap[MSGPACK_OBJECT_BOOLEAN] = mex_unpack_boolean;
-    unPackMap[MSGPACK_OBJECT_POSITIVE_INTEGER] = mex_unpack_positive_integer;
-    unPackMap[MSGPACK_OBJECT_NEGATIVE_INTEGER] = mex_unpack_negative_integer;
-    unPackMap[MSGPACK_OBJECT_FLOAT32] = mex_unpack_float;
-    unPackMap[MSGPACK_OBJECT_FLOAT64] = mex_unpack_double;
-    unPackMap[MSGPACK_OBJECT_STR] = mex_unpack_str;
-    unPackMap[MSGPACK_OBJECT_ARRAY] = mex_unpack_array;
-    unPackMap[MSGPACK_OBJECT_MAP] = mex_unpack_map;
-    unPackMap[MSGPACK_OBJECT_BIN] = mex_unpack_bin;
-    unPackMap[MSGPACK_OBJECT_EXT] = mex_unpack_ext;
-
     // These pack to MessagePack types. Others raise errors or pack to nil.
     PackMap[mxCELL_CLASS] = mex_pack_cell;
     PackMap[mxSTRUCT_CLASS] = mex_pack_struct;
@@ -910,6 +2049,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     PackMap[mxUINT32_CLASS] = mex_pack_uint32;
     PackMap[mxINT64_CLASS] = mex_pack_int64;
     PackMap[mxUINT64_CLASS] = mex_pack_uint64;
+    reset_ext_codecs();
 
     mexAtExit(mexExit);
     init = true;
@@ -936,6 +2076,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     else if (*it == "-unpack_ext_w_tag") flags.unpack_ext_w_tag = false;
     else if (*it == "+pack_other_as_nil") flags.pack_other_as_nil = true;
     else if (*it == "-pack_other_as_nil") flags.pack_other_as_nil = false;
+    else if (*it == "+unpack_records") flags.unpack_records = true;
+    else if (*it == "-unpack_records") flags.unpack_records = false;
+    else if (*it == "+unpack_str_array_as_string") flags.unpack_str_array_as_string = true;
+    else if (*it == "-unpack_str_array_as_string") flags.unpack_str_array_as_string = false;
+    else if (set_limit(*it)) continue;
     else if (it->length() > 12 && it->substr(1, 11) == "unpack_nil_") {
       string remainder = it->substr(12, it->length() - 12);
       if (remainder == "zero") flags.unpack_nil = UNPACK_NIL_ZERO;
@@ -947,12 +2092,19 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
     else mexErrMsgIdAndTxt("msgpack:invalid_flag", "%s is not a valid flag.", it->c_str());
   }
+  // Drop frames left behind by a previous call that ended in an error.
+  object_unpacker.reset();
+  stream_unpacker.reset();
+  free_tree();
+  pack_stack.clear();
+  ring_release_unpacking();
   // Handle command
   if (cmd == "set_flags") {
     // flags already processed above
     return;
   } else if (cmd == "reset_flags") {
     flags = mp_flags();
+    limits = mp_limits();
     return;
   } else if (cmd == "print_flags") {
     print_flags();
@@ -963,6 +2115,40 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     mex_unpack(nlhs, plhs, nrhs-1, prhs+1);
   else if (cmd == "unpacker")
     mex_unpacker_std(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "unpack_table")
+    mex_unpack_table(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "writer_open")
+    mex_writer_open(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "writer_append")
+    mex_writer_append(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "writer_flush")
+    mex_writer_flush(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "writer_close")
+    mex_writer_close(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "prescan")
+    mex_prescan(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "ring_open")
+    mex_ring_open(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "ring_pack")
+    mex_ring_pack(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "ring_unpack")
+    mex_ring_unpack(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "ring_close")
+    mex_ring_close(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "ring_unlink")
+    mex_ring_unlink(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "register_schema")
+    mex_register_schema(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "unpack_schema")
+    mex_unpack_schema(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "clear_schemas")
+    schemas.clear();
+  else if (cmd == "register_ext")
+    mex_register_ext(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "unregister_ext")
+    mex_unregister_ext(nlhs, plhs, nrhs-1, prhs+1);
+  else if (cmd == "list_ext")
+    mex_list_ext(nlhs, plhs, nrhs-1, prhs+1);
   else if (cmd == "help")
     mexPrintf(
       "See README.md for full details.\n"
@@ -974,11 +2160,19 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
       "  unpack_ext_w_tag\n"
       "  pack_other_as_nil\n"
       "  unpack_nil_array_skip\n"
+      "  unpack_records\n"
+      "  unpack_str_array_as_string\n"
       "Also, +unpack_nil_ may be set as one of the following (no unset):\n"
       "  +unpack_nil_zero (default)\n"
       "  +unpack_nil_NaN\n"
       "  +unpack_nil_empty\n"
       "  +unpack_nil_cell\n"
+      "Limits are set with <name>=<value> in the same way:\n"
+      "  max_depth (default 1000)\n"
+      "  max_bytes (default Inf)\n"
+      "  max_container_len (default Inf)\n"
+      "  max_str_len (default Inf)\n"
+      "  max_chunk_len (default 4294967295)\n"
       "\n");
   else
     mexErrMsgIdAndTxt("msgpack:bad_command",
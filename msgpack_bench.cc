@@ -0,0 +1,245 @@
+/*
+ * MessagePack for Matlab - native benchmark of the converter core
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* Times the unpack paths of the MEX file without MATLAB, building NativeValues instead of mxArrays
+ * with the same core the MEX file uses: pre-scan, then either parse and build from the
+ * object tree (unpack_schema, +unpack_records) or the one-pass stream decoder (everything else).
+ *
+ *   g++ -O2 -std=c++11 -o msgpack_bench msgpack_bench.cc -lmsgpack
+ *   ./msgpack_bench [-n iterations] [+flag|-flag ...] [file ...]
+ *
+ * Each file is read as a sequence of messages. Without files, a set of synthetic payloads is used.
+ * Flags are the unpack flags of msgpack('set_flags', ...). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "msgpack_native.h"
+
+static mp_flags flags;
+static mp_limits limits;
+
+struct Payload {
+  string name;
+  msgpack_sbuffer buf;
+};
+
+double now_ms() {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void pack_str(msgpack_packer* pk, const string& s) {
+  msgpack_pack_str(pk, s.size());
+  msgpack_pack_str_body(pk, s.data(), s.size());
+}
+
+Payload* new_payload(const string& name, msgpack_packer* pk) {
+  Payload* p = new Payload();
+  p->name = name;
+  msgpack_sbuffer_init(&p->buf);
+  msgpack_packer_init(pk, &p->buf, msgpack_sbuffer_write);
+  return p;
+}
+
+void synthetic_payloads(vector<Payload*>& payloads) {
+  msgpack_packer pk;
+  const size_t n = 1000000;
+  Payload* p = new_payload("doubles", &pk);
+  msgpack_pack_array(&pk, n);
+  for (size_t i = 0; i < n; i++) msgpack_pack_double(&pk, i * 0.5);
+  payloads.push_back(p);
+
+  p = new_payload("ints", &pk);
+  msgpack_pack_array(&pk, n);
+  for (size_t i = 0; i < n; i++) msgpack_pack_uint64(&pk, (i * 2654435761u) % 100000);
+  payloads.push_back(p);
+
+  p = new_payload("strings", &pk);
+  msgpack_pack_array(&pk, n / 5);
+  for (size_t i = 0; i < n / 5; i++) pack_str(&pk, "label_" + std::to_string(i % 1000));
+  payloads.push_back(p);
+
+  p = new_payload("records", &pk);
+  msgpack_pack_array(&pk, n / 10);
+  for (size_t i = 0; i < n / 10; i++) {
+    msgpack_pack_map(&pk, 3);
+    pack_str(&pk, "t");
+    msgpack_pack_uint64(&pk, i);
+    pack_str(&pk, "x");
+    msgpack_pack_double(&pk, i * 0.25);
+    pack_str(&pk, "id");
+    pack_str(&pk, "sensor_" + std::to_string(i % 16));
+  }
+  payloads.push_back(p);
+
+  p = new_payload("mixed", &pk);
+  msgpack_pack_array(&pk, n / 10);
+  for (size_t i = 0; i < n / 10; i++) {
+    msgpack_pack_array(&pk, 3);
+    msgpack_pack_int64(&pk, -(int64_t)i);
+    pack_str(&pk, "x");
+    msgpack_pack_array(&pk, 2);
+    msgpack_pack_float(&pk, i * 0.5f);
+    msgpack_pack_nil(&pk);
+  }
+  payloads.push_back(p);
+}
+
+bool read_file(const char* path, vector<Payload*>& payloads) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  Payload* p = new Payload();
+  p->name = path;
+  msgpack_sbuffer_init(&p->buf);
+  char chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) msgpack_sbuffer_write(&p->buf, chunk, n);
+  fclose(f);
+  payloads.push_back(p);
+  return true;
+}
+
+bool set_flag(const string& flag) {
+  struct {const char* name; bool* val;} bool_flags[] = {
+    {"unicode_strs", &flags.unicode_strs},
+    {"unpack_map_as_cells", &flags.unpack_map_as_cells},
+    {"unpack_narrow", &flags.unpack_narrow},
+    {"unpack_ext_w_tag", &flags.unpack_ext_w_tag},
+    {"unpack_nil_array_skip", &flags.unpack_nil_array_skip},
+    {"unpack_records", &flags.unpack_records},
+    {"unpack_str_array_as_string", &flags.unpack_str_array_as_string},
+  };
+  for (size_t i = 0; i < sizeof(bool_flags) / sizeof(bool_flags[0]); i++) {
+    if (flag.substr(1) == bool_flags[i].name) {
+      *bool_flags[i].val = (flag[0] == '+');
+      return true;
+    }
+  }
+  if (flag == "+unpack_nil_zero") flags.unpack_nil = UNPACK_NIL_ZERO;
+  else if (flag == "+unpack_nil_NaN") flags.unpack_nil = UNPACK_NIL_NAN;
+  else if (flag == "+unpack_nil_empty") flags.unpack_nil = UNPACK_NIL_EMPTY;
+  else if (flag == "+unpack_nil_cell") flags.unpack_nil = UNPACK_NIL_CELL;
+  else return false;
+  return true;
+}
+
+// Unpack every message in p once through the object tree. Adds the time spent in each stage to
+// the totals.
+size_t run_object(Payload* p, NativeBuilder& builder, ObjectUnpacker<NativeBuilder>& unpacker,
+                  StreamUnpacker<NativeBuilder>& reader, double* prescan_ms, double* parse_ms,
+                  double* build_ms) {
+  msgpack_zone* zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  size_t offset = 0, count = 0;
+  while (offset < p->buf.size) {
+    double t0 = now_ms();
+    PrescanStats stats;
+    if (prescan_message(p->buf.data + offset, p->buf.size - offset, limits, &stats) != PRESCAN_OK)
+      throw std::runtime_error("prescan failed at offset " + std::to_string(offset));
+    double t1 = now_ms();
+    msgpack_zone_clear(zone);
+    msgpack_object tree = reader.read_tree(p->buf.data, p->buf.size, &offset, zone);
+    double t2 = now_ms();
+    unpacker.unpack(tree);
+    double t3 = now_ms();
+    *prescan_ms += t1 - t0;
+    *parse_ms += t2 - t1;
+    *build_ms += t3 - t2;
+    count++;
+  }
+  msgpack_zone_free(zone);
+  builder.clear();
+  return count;
+}
+
+// Unpack every message in p once with the stream decoder. Returns the time spent after pre-scans.
+double run_stream(Payload* p, NativeBuilder& builder, StreamUnpacker<NativeBuilder>& unpacker) {
+  size_t offset = 0;
+  double ms = 0;
+  while (offset < p->buf.size) {
+    PrescanStats stats;
+    if (prescan_message(p->buf.data + offset, p->buf.size - offset, limits, &stats) != PRESCAN_OK)
+      throw std::runtime_error("prescan failed at offset " + std::to_string(offset));
+    double t0 = now_ms();
+    unpacker.unpack(p->buf.data, p->buf.size, &offset);
+    ms += now_ms() - t0;
+  }
+  builder.clear();
+  return ms;
+}
+
+int main(int argc, char** argv) {
+  int iterations = 5;
+  vector<Payload*> payloads;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if ((arg[0] == '+' || arg[0] == '-') && arg.size() > 1) {
+      if (!set_flag(arg)) {
+        fprintf(stderr, "Unknown flag %s\n", arg.c_str());
+        return 2;
+      }
+    } else if (!read_file(argv[i], payloads)) {
+      fprintf(stderr, "Can't read %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (payloads.empty()) synthetic_payloads(payloads);
+
+  NativeBuilder builder;
+  ObjectUnpacker<NativeBuilder> unpacker(builder, flags, limits);
+  StreamUnpacker<NativeBuilder> stream_unpacker(builder, flags, limits);
+  printf("%-12s %10s %6s %11s %11s %11s %9s %11s %9s\n", "payload", "bytes", "msgs", "prescan ms",
+         "parse ms", "build ms", "MB/s", "stream ms", "MB/s");
+  for (size_t k = 0; k < payloads.size(); k++) {
+    Payload* p = payloads[k];
+    double best = 0, best_prescan = 0, best_parse = 0, best_build = 0, best_stream = 0;
+    size_t count = 0;
+    for (int it = 0; it < iterations; it++) {
+      double prescan_ms = 0, parse_ms = 0, build_ms = 0, stream_ms = 0;
+      try {
+        count = run_object(p, builder, unpacker, stream_unpacker, &prescan_ms, &parse_ms, &build_ms);
+        if (!flags.unpack_records) stream_ms = run_stream(p, builder, stream_unpacker);
+      } catch (const std::exception& e) {
+        fprintf(stderr, "%s: %s\n", p->name.c_str(), e.what());
+        return 1;
+      }
+      double total = prescan_ms + parse_ms + build_ms;
+      if (it == 0 || total < best) {
+        best = total;
+        best_prescan = prescan_ms;
+        best_parse = parse_ms;
+        best_build = build_ms;
+      }
+      if (it == 0 || stream_ms < best_stream) best_stream = stream_ms;
+    }
+    // Throughputs include the pre-scan, as in the MEX file.
+    printf("%-12s %10zu %6zu %11.2f %11.2f %11.2f %9.1f", p->name.c_str(), p->buf.size, count,
+           best_prescan, best_parse, best_build, p->buf.size / 1e3 / best);
+    if (flags.unpack_records)
+      printf(" %11s %9s\n", "-", "-");
+    else
+      printf(" %11.2f %9.1f\n", best_stream, p->buf.size / 1e3 / (best_prescan + best_stream));
+    msgpack_sbuffer_destroy(&p->buf);
+    delete p;
+  }
+  return 0;
+}
@@ -0,0 +1,1548 @@
+/*
+ * MessagePack for Matlab - converter core
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* The msgpack -> value translation behind msgpack('unpack', ...): type scans, nil handling,
+ * narrowing, maps, records and strings. It doesn't depend on MATLAB. Values are created through a
+ * Builder, so the same rules can build mxArrays (MexBuilder in msgpack.cc) or plain C++ objects
+ * (NativeBuilder in msgpack_native.h, used by msgpack_bench.cc).
+ *
+ * A Builder provides:
+ *
+ *   typedef ... Value;                                      // e.g. mxArray*
+ *   Value create_numeric(NumClass cls, size_t n, void** data);  // zeroed 1xn row at *data
+ *   Value create_empty();                                   // 0x0 double
+ *   Value create_char(const char* utf8, size_t n);          // 1xN char, 0x0 if n == 0
+ *   Value create_cell(size_t rows, size_t cols);
+ *   void set_cell(Value cell, size_t i, Value v);           // column-major index
+ *   Value create_struct(const vector<string>& names);       // 1x1, fields in this order
+ *   void set_field(Value s, size_t i, Value v);
+ *   Value to_string_array(Value cellstr);                   // for +unpack_str_array_as_string
+ *   bool create_ext(const ExtPayload& ext, Value* out);     // false for the generic {code, bytes}
+ *   void destroy(Value v);                                  // free a value that won't be used
+ *   void error(const char* id, const char* msg);            // must not return
+ *   void warning(const char* id, const char* msg);
+ */
+
+#ifndef MSGPACK_CORE_H
+#define MSGPACK_CORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <msgpack.h>
+
+enum NilUnpack {UNPACK_NIL_ZERO, UNPACK_NIL_NAN, UNPACK_NIL_EMPTY, UNPACK_NIL_CELL};
+
+struct mp_flags {
+  bool unicode_strs = true;
+  bool pack_u8_bin = false;
+  bool unpack_map_as_cells = false;
+  bool unpack_narrow = false;
+  bool unpack_ext_w_tag = false;
+  bool pack_other_as_nil = true;
+  NilUnpack unpack_nil = UNPACK_NIL_ZERO;
+  bool unpack_nil_array_skip = true;
+  bool unpack_records = false;
+  bool unpack_str_array_as_string = false;
+};
+
+// Numeric settings, set like flags with <name>=<value>.
+struct mp_limits {
+  size_t max_depth = 1000;  // Maximum nesting of containers when packing or unpacking
+  size_t max_bytes = SIZE_MAX;  // Maximum projected memory to unpack one message
+  size_t max_container_len = SIZE_MAX;  // Maximum elements in an array or pairs in a map
+  size_t max_str_len = SIZE_MAX;  // Maximum bytes in a str, bin or ext
+  size_t max_chunk_len = UINT32_MAX;  // Longest array, str, bin or ext packed in one piece
+};
+
+// MessagePack lengths are 32-bit, so a longer array, str, bin or ext is packed as an array of a
+// marker ext followed by the pieces, each a container of the original type. The marker's payload
+// is the total length (elements or bytes) as a little-endian uint64. Every piece but the last has
+// the same length. Unpacking joins the pieces again, but only if they have exactly that shape (see
+// ChunkShape); otherwise the array is plain data that happens to start with an ext 74.
+static const int8_t EXT_CHUNKED = 0x4A;  // 'J'
+
+// Classes of the numeric rows a Builder creates.
+enum NumClass {NUM_LOGICAL, NUM_DOUBLE, NUM_SINGLE, NUM_INT8, NUM_UINT8, NUM_INT16, NUM_UINT16,
+               NUM_INT32, NUM_UINT32, NUM_INT64, NUM_UINT64};
+
+// Element size and MATLAB class name of each NumClass.
+static const size_t num_class_size[] = {1, 8, 4, 1, 1, 2, 2, 4, 4, 8, 8};
+static const char* const num_class_names[] = {"logical", "double", "single", "int8", "uint8",
+                                              "int16", "uint16", "int32", "uint32", "int64",
+                                              "uint64"};
+
+// What an ext code decodes to. The MATLAB kinds are decoded by the Builder; the others by
+// decode_ext from their little-endian payloads.
+enum ExtKind {
+  EXT_KIND_NONE,          // The generic {code, bytes}
+  EXT_KIND_TYPED,         // Packed elements of cls -> 1xN cls
+  EXT_KIND_BITSET,        // uint64 bit count, then bits least significant first -> 1xN logical
+  EXT_KIND_FIXED,         // Packed integers of cls times scale -> 1xN double
+  EXT_KIND_COMPLEX,       // MATLAB-specific kinds
+  EXT_KIND_DATETIME,
+  EXT_KIND_STRING_ARRAY,
+  EXT_KIND_CATEGORICAL
+};
+
+static const char* const ext_kind_names[] = {"none", "typed", "bitset", "fixed", "complex",
+                                             "datetime", "string", "categorical"};
+
+struct ExtCodec {
+  ExtKind kind;
+  NumClass cls;  // For typed and fixed
+  double scale;  // For fixed
+};
+
+// An ext payload. Unlike msgpack_object's, its size may be over 32 bits (a joined chunked ext).
+struct ExtPayload {
+  int8_t type;
+  const char* ptr;
+  size_t size;
+};
+
+inline ExtPayload ext_payload(const msgpack_object& obj) {
+  ExtPayload ext = {obj.via.ext.type, obj.via.ext.ptr, obj.via.ext.size};
+  return ext;
+}
+
+// True if obj is a chunk marker (see EXT_CHUNKED). *total is the length it announces.
+inline bool is_chunk_marker(const msgpack_object& obj, uint64_t* total) {
+  if (obj.type != MSGPACK_OBJECT_EXT || obj.via.ext.type != EXT_CHUNKED ||
+      obj.via.ext.size != sizeof(uint64_t))
+    return false;
+  memcpy(total, obj.via.ext.ptr, sizeof(uint64_t));  // little-endian
+  return true;
+}
+
+// Checks the pieces after a chunk marker, one header at a time, against the shape the packer
+// gives: at least one piece, all arrays or all strs, bins or exts of one code, each no longer than
+// the first and all but the last exactly as long, adding up to the total.
+class ChunkShape {
+ public:
+  explicit ChunkShape(uint64_t total) : total(total), len(0), sum(0), type(-1), code(0),
+                                        last(false), ok(true) {}
+
+  // Add a piece with its length (elements or bytes). Returns false once the shape is broken.
+  bool add(const msgpack_object& piece, uint64_t n) {
+    int8_t piece_code = (piece.type == MSGPACK_OBJECT_EXT) ? piece.via.ext.type : 0;
+    if (type < 0) {
+      ok = piece.type == MSGPACK_OBJECT_ARRAY || piece.type == MSGPACK_OBJECT_STR ||
+           piece.type == MSGPACK_OBJECT_BIN || piece.type == MSGPACK_OBJECT_EXT;
+      type = piece.type;
+      code = piece_code;
+      len = n;
+    }
+    ok = ok && !last && piece.type == type && piece_code == code && n > 0 && n <= len &&
+         n <= total - sum;
+    last = (n < len);
+    sum += n;
+    return ok;
+  }
+
+  // Whether the pieces added so far are the whole chunked container.
+  bool complete() const { return ok && type >= 0 && sum == total; }
+
+ private:
+  uint64_t total, len, sum;
+  int type;  // msgpack_object_type of the pieces, or -1 before the first
+  int8_t code;
+  bool last;  // A shorter piece was seen, so it has to be the last
+  bool ok;
+};
+
+// The length of a piece: elements of an array, bytes of a str, bin or ext.
+inline uint64_t chunk_piece_len(const msgpack_object& obj) {
+  switch (obj.type) {
+    case MSGPACK_OBJECT_ARRAY: return obj.via.array.size;
+    case MSGPACK_OBJECT_STR: return obj.via.str.size;
+    case MSGPACK_OBJECT_BIN: return obj.via.bin.size;
+    case MSGPACK_OBJECT_EXT: return obj.via.ext.size;
+    default: return 0;
+  }
+}
+
+// True if obj is an array of a chunk marker and pieces of the right shape (see ChunkShape).
+inline bool is_chunked(const msgpack_object& obj, uint64_t* total) {
+  if (obj.type != MSGPACK_OBJECT_ARRAY || obj.via.array.size < 2 ||
+      !is_chunk_marker(obj.via.array.ptr[0], total))
+    return false;
+  ChunkShape shape(*total);
+  for (uint32_t k = 1; k < obj.via.array.size; k++) {
+    const msgpack_object& piece = obj.via.array.ptr[k];
+    if (!shape.add(piece, chunk_piece_len(piece))) return false;
+  }
+  return shape.complete();
+}
+
+// Decode n bytes of UTF-8 into dst, which must have room for n code units. Invalid sequences
+// become U+FFFD. Returns the number of UTF-16 code units written.
+inline size_t utf8_to_utf16(const char* src, size_t n, uint16_t* dst) {
+  const uint8_t* s = (const uint8_t*)src;
+  size_t i = 0, j = 0;
+  while (i < n) {
+    uint32_t c = s[i];
+    if (c < 0x80) {
+      dst[j++] = c;
+      i++;
+      continue;
+    }
+    size_t len = 0;
+    uint32_t min_c = 0;
+    if ((c & 0xE0) == 0xC0) { len = 2; c &= 0x1F; min_c = 0x80; }
+    else if ((c & 0xF0) == 0xE0) { len = 3; c &= 0x0F; min_c = 0x800; }
+    else if ((c & 0xF8) == 0xF0) { len = 4; c &= 0x07; min_c = 0x10000; }
+    bool ok = (len > 0 && i + len <= n);
+    for (size_t k = 1; ok && k < len; k++) {
+      if ((s[i + k] & 0xC0) != 0x80) ok = false;
+      c = (c << 6) | (s[i + k] & 0x3F);
+    }
+    if (!ok || c < min_c || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+      dst[j++] = 0xFFFD;
+      i++;
+      continue;
+    }
+    i += len;
+    if (c >= 0x10000) {
+      c -= 0x10000;
+      dst[j++] = 0xD800 + (c >> 10);
+      dst[j++] = 0xDC00 + (c & 0x3FF);
+    } else {
+      dst[j++] = c;
+    }
+  }
+  return j;
+}
+
+// Header-only pre-scan of one message, run before msgpack-c builds the object tree. msgpack-c
+// allocates an array or map's element storage as soon as it reads the header, so hostile sizes
+// have to be caught here. Nothing is allocated apart from a small stack of pending item counts.
+enum PrescanResult {PRESCAN_OK, PRESCAN_INCOMPLETE, PRESCAN_MALFORMED, PRESCAN_LIMIT};
+
+struct PrescanStats {
+  size_t bytes;              // Encoded size of the message (bytes scanned so far if not OK)
+  size_t objects;            // msgpack objects, counting map keys
+  size_t depth;              // Deepest container nesting
+  size_t max_container_len;  // Largest array or map (in pairs)
+  size_t max_str_len;        // Largest str, bin or ext payload
+  size_t projected_bytes;    // Approximate memory needed to unpack
+  const char* limit;         // Name of the limit exceeded, for PRESCAN_LIMIT
+};
+
+// Rough per-mxArray overhead used for projected_bytes. Projections assume every object becomes its
+// own mxArray, so they overestimate messages that unpack to typed arrays.
+static const size_t MX_ARRAY_OVERHEAD = 104;
+
+// Big-endian length of width 1, 2 or 4 bytes.
+inline size_t read_be_len(const uint8_t* p, size_t width) {
+  size_t len = 0;
+  for (size_t k = 0; k < width; k++) len = (len << 8) | p[k];
+  return len;
+}
+
+inline PrescanResult prescan_message(const char* data, size_t size, const mp_limits& limits,
+                                     PrescanStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  const uint8_t* p = (const uint8_t*)data;
+  size_t pos = 0;
+  vector<uint64_t> pending(1, 1);  // Items left to read at each open level; the root is one item.
+  while (true) {
+    while (!pending.empty() && pending.back() == 0) pending.pop_back();
+    if (pending.empty()) break;
+    pending.back()--;
+    if (pos >= size) {
+      stats->bytes = pos;
+      return PRESCAN_INCOMPLETE;
+    }
+    uint8_t b = p[pos];
+    size_t header = 1;      // Bytes before the payload, including b
+    size_t width = 0;       // Width of a big-endian length field following b
+    size_t payload = 0;     // Bytes following the header (fixed-size scalars)
+    size_t container = 0;   // Items in an array or map (2 per map pair)
+    size_t len = 0;         // str/bin/ext length or array/map count, once known
+    bool is_container = false, is_map = false, is_raw = false, is_utf8 = false;
+    if (b <= 0x7f || b >= 0xe0 || b == 0xc0 || b == 0xc2 || b == 0xc3) {
+      // fixint, nil, bool
+    } else if (b >= 0x80 && b <= 0x8f) {
+      is_container = is_map = true;
+      len = b & 0x0f;
+    } else if (b >= 0x90 && b <= 0x9f) {
+      is_container = true;
+      len = b & 0x0f;
+    } else if (b >= 0xa0 && b <= 0xbf) {
+      is_raw = is_utf8 = true;
+      len = b & 0x1f;
+    } else {
+      switch (b) {
+        case 0xcc: case 0xd0: payload = 1; break;
+        case 0xcd: case 0xd1: payload = 2; break;
+        case 0xca: case 0xce: case 0xd2: payload = 4; break;
+        case 0xcb: case 0xcf: case 0xd3: payload = 8; break;
+        case 0xd4: payload = 2; is_raw = true; break;   // fixext: type byte + 1..16 bytes
+        case 0xd5: payload = 3; is_raw = true; break;
+        case 0xd6: payload = 5; is_raw = true; break;
+        case 0xd7: payload = 9; is_raw = true; break;
+        case 0xd8: payload = 17; is_raw = true; break;
+        case 0xd9: width = 1; is_raw = is_utf8 = true; break;
+        case 0xda: width = 2; is_raw = is_utf8 = true; break;
+        case 0xdb: width = 4; is_raw = is_utf8 = true; break;
+        case 0xc4: width = 1; is_raw = true; break;
+        case 0xc5: width = 2; is_raw = true; break;
+        case 0xc6: width = 4; is_raw = true; break;
+        case 0xc7: width = 1; header = 2; is_raw = true; break;  // ext: length, then type byte
+        case 0xc8: width = 2; header = 2; is_raw = true; break;
+        case 0xc9: width = 4; header = 2; is_raw = true; break;
+        case 0xdc: width = 2; is_container = true; break;
+        case 0xdd: width = 4; is_container = true; break;
+        case 0xde: width = 2; is_container = is_map = true; break;
+        case 0xdf: width = 4; is_container = is_map = true; break;
+        default:  // 0xc1 is never used
+          stats->bytes = pos;
+          return PRESCAN_MALFORMED;
+      }
+    }
+    if (width) {
+      if (size - pos < 1 + width + (header - 1)) {
+        stats->bytes = pos;
+        return PRESCAN_INCOMPLETE;
+      }
+      len = read_be_len(p + pos + 1, width);
+      header += width;
+    }
+    if (is_raw && b >= 0xd4 && b <= 0xd8) len = payload - 1;
+    else if (is_raw) payload = len;
+    stats->objects++;
+    size_t mx_bytes = MX_ARRAY_OVERHEAD;
+    if (is_raw) {
+      stats->max_str_len = std::max(stats->max_str_len, len);
+      if (len > limits.max_str_len) {
+        stats->bytes = pos;
+        stats->limit = "max_str_len";
+        return PRESCAN_LIMIT;
+      }
+      mx_bytes += is_utf8 ? len * sizeof(uint16_t) : len;
+    } else if (is_container) {
+      container = is_map ? 2 * (uint64_t)len : len;
+      stats->max_container_len = std::max(stats->max_container_len, len);
+      stats->depth = std::max(stats->depth, pending.size());
+      if (len > limits.max_container_len) {
+        stats->bytes = pos;
+        stats->limit = "max_container_len";
+        return PRESCAN_LIMIT;
+      }
+      if (pending.size() > limits.max_depth) {
+        stats->bytes = pos;
+        stats->limit = "max_depth";
+        return PRESCAN_LIMIT;
+      }
+      mx_bytes += container * sizeof(void*);
+    } else {
+      mx_bytes += sizeof(double);
+    }
+    stats->projected_bytes += sizeof(msgpack_object) + mx_bytes;
+    if (stats->projected_bytes > limits.max_bytes) {
+      stats->bytes = pos;
+      stats->limit = "max_bytes";
+      return PRESCAN_LIMIT;
+    }
+    if (size - pos < header || size - pos - header < payload) {
+      stats->bytes = pos;
+      return PRESCAN_INCOMPLETE;
+    }
+    pos += header + payload;
+    if (container) {
+      // Every item takes at least one byte, so a count beyond the rest of the buffer can't be
+      // satisfied yet. Stop here rather than let msgpack-c allocate for it.
+      if (container > size - pos) {
+        stats->bytes = pos;
+        return PRESCAN_INCOMPLETE;
+      }
+      pending.push_back(container);
+    }
+  }
+  stats->bytes = pos;
+  return PRESCAN_OK;
+}
+
+template <class T>
+void scale_fixed(const char* src, size_t n, double scale, double* dst) {
+  for (size_t i = 0; i < n; i++) {
+    T raw;
+    memcpy(&raw, src + i * sizeof(T), sizeof(T));  // little-endian, possibly unaligned
+    dst[i] = raw * scale;
+  }
+}
+
+// Decode an ext payload of a typed, bitset or fixed kind. Typed payloads are copied as they are,
+// since MATLAB only runs on little-endian hosts. Returns false if the payload size doesn't fit the
+// kind, so it can be unpacked as the generic {code, bytes}.
+template <class Builder>
+bool decode_ext(Builder& b, const ExtCodec& codec, const ExtPayload& ext,
+                typename Builder::Value* out) {
+  const char* src = ext.ptr;
+  size_t size = ext.size;
+  size_t elsize = num_class_size[codec.cls];
+  void* data = NULL;
+  switch (codec.kind) {
+    case EXT_KIND_TYPED:
+      if (size % elsize) return false;
+      *out = b.create_numeric(codec.cls, size / elsize, &data);
+      if (size) memcpy(data, src, size);
+      return true;
+    case EXT_KIND_BITSET: {
+      uint64_t nbits;
+      if (size < sizeof(nbits)) return false;
+      memcpy(&nbits, src, sizeof(nbits));
+      src += sizeof(nbits);
+      size -= sizeof(nbits);
+      if (nbits > 8 * (uint64_t)size || (nbits + 7) / 8 != size) return false;
+      *out = b.create_numeric(NUM_LOGICAL, nbits, &data);
+      bool* bits = (bool*)data;
+      for (size_t i = 0; i < nbits; i++) bits[i] = ((uint8_t)src[i >> 3] >> (i & 7)) & 1;
+      return true;
+    }
+    case EXT_KIND_FIXED: {
+      if (size % elsize) return false;
+      size_t n = size / elsize;
+      *out = b.create_numeric(NUM_DOUBLE, n, &data);
+      double* dst = (double*)data;
+      switch (codec.cls) {
+        case NUM_INT8: scale_fixed<int8_t>(src, n, codec.scale, dst); break;
+        case NUM_UINT8: scale_fixed<uint8_t>(src, n, codec.scale, dst); break;
+        case NUM_INT16: scale_fixed<int16_t>(src, n, codec.scale, dst); break;
+        case NUM_UINT16: scale_fixed<uint16_t>(src, n, codec.scale, dst); break;
+        case NUM_INT32: scale_fixed<int32_t>(src, n, codec.scale, dst); break;
+        case NUM_UINT32: scale_fixed<uint32_t>(src, n, codec.scale, dst); break;
+        case NUM_INT64: scale_fixed<int64_t>(src, n, codec.scale, dst); break;
+        default: scale_fixed<uint64_t>(src, n, codec.scale, dst); break;  // NUM_UINT64
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Containers are filled from an explicit work stack, so that deeply nested data doesn't recurse
+// on the C stack. A frame holds a container that has already been created and the position of the
+// next child to fill in.
+enum UnpackFrameKind {
+  FRAME_CELLS,          // elems[i] -> cell i
+  FRAME_CHUNKS,         // element i of the chunked array whose pieces are elems -> cell i
+  FRAME_RECORD_COLUMN,  // value for key `key` of map elems[i] -> cell i
+  FRAME_FIELDS,         // kvs[i].val -> field i
+  FRAME_MAP_CELLS       // kvs[i/2].key or .val -> cell i of a 2xN cell
+};
+
+// Element accessors for ObjectUnpacker::array_elems
+struct ArrayElems {
+  static const UnpackFrameKind kind = FRAME_CELLS;
+  const msgpack_object* base;
+  uint32_t key;  // Unused
+  const msgpack_object& operator[](size_t i) const { return base[i]; }
+};
+
+struct ChunkedElems {
+  static const UnpackFrameKind kind = FRAME_CHUNKS;
+  const msgpack_object* base;  // The pieces
+  uint32_t key;                // Length of every piece but the last
+  const msgpack_object& operator[](size_t i) const {
+    return base[i / key].via.array.ptr[i % key];
+  }
+};
+
+// Check the n pieces of a chunked array (see EXT_CHUNKED) against the total from its marker and
+// set *elems to read them as one array. Returns false if they don't fit together.
+inline bool chunked_array_elems(const msgpack_object* chunks, size_t n, uint64_t total,
+                                ChunkedElems* elems) {
+  if (n == 0 || chunks[0].type != MSGPACK_OBJECT_ARRAY) return false;
+  uint32_t len = chunks[0].via.array.size;
+  uint64_t sum = 0;
+  for (size_t k = 0; k < n; k++) {
+    uint32_t size = chunks[k].via.array.size;
+    if (chunks[k].type != MSGPACK_OBJECT_ARRAY || size == 0 || size > len ||
+        (k + 1 < n && size != len))
+      return false;
+    sum += size;
+  }
+  if (sum != total) return false;
+  elems->base = chunks;
+  elems->key = len;
+  return true;
+}
+
+struct RecordColumn {
+  static const UnpackFrameKind kind = FRAME_RECORD_COLUMN;
+  const msgpack_object* base;  // The records
+  uint32_t key;
+  const msgpack_object& operator[](size_t i) const { return base[i].via.map.ptr[key].val; }
+};
+
+// The rules shared by ObjectUnpacker and StreamUnpacker: how scalars, strs, bins and exts become
+// values, and when the elements of an array become a single-type row. Flags and limits are read at
+// the time of each call.
+template <class Builder>
+class UnpackRules {
+ public:
+  typedef typename Builder::Value Value;
+
+ protected:
+  UnpackRules(Builder& builder, const mp_flags& flags, const mp_limits& limits)
+      : b(builder), flags(flags), limits(limits) {}
+
+  Builder& b;
+  const mp_flags& flags;
+  const mp_limits& limits;
+  vector<char> joined;  // The bytes of a chunked str, bin or ext while it is unpacked
+
+  // Called before filling the children of a container at the given depth (the root is 0).
+  void check_depth(size_t depth) {
+    if (depth >= limits.max_depth) {
+      char msg[64];
+      snprintf(msg, sizeof(msg), "Nesting deeper than max_depth=%zu.", limits.max_depth);
+      b.error("msgpack:max_depth", msg);
+    }
+  }
+
+  // Unpack an object that isn't an array or map.
+  Value leaf(const msgpack_object& obj) {
+    switch (obj.type) {
+      case MSGPACK_OBJECT_NIL:
+        return nil();
+      case MSGPACK_OBJECT_BOOLEAN:
+        return scalar<bool>(NUM_LOGICAL, obj.via.boolean);
+      case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        return positive_integer(obj.via.u64);
+      case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        return negative_integer(obj.via.i64);
+      case MSGPACK_OBJECT_FLOAT32:
+        if (flags.unpack_narrow) return scalar<float>(NUM_SINGLE, (float)obj.via.f64);
+        return scalar<double>(NUM_DOUBLE, obj.via.f64);
+      case MSGPACK_OBJECT_FLOAT64:
+        return scalar<double>(NUM_DOUBLE, obj.via.f64);
+      case MSGPACK_OBJECT_STR:
+        return str(obj.via.str.ptr, obj.via.str.size);
+      case MSGPACK_OBJECT_BIN:
+        return bytes(obj.via.bin.ptr, obj.via.bin.size);
+      case MSGPACK_OBJECT_EXT:
+        return ext(ext_payload(obj));
+      default: {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Don't know how to unpack object type %d.", (int)obj.type);
+        b.error("msgpack:unpack_bad_object_type", msg);
+        return Value();
+      }
+    }
+  }
+
+  template <class T>
+  Value scalar(NumClass cls, T val) {
+    void* data = NULL;
+    Value ret = b.create_numeric(cls, 1, &data);
+    *(T*)data = val;
+    return ret;
+  }
+
+  Value positive_integer(uint64_t val) {
+    if (!flags.unpack_narrow) return scalar<double>(NUM_DOUBLE, (double)val);
+    if ((uint8_t)val == val) return scalar<uint8_t>(NUM_UINT8, val);
+    if ((uint16_t)val == val) return scalar<uint16_t>(NUM_UINT16, val);
+    if ((uint32_t)val == val) return scalar<uint32_t>(NUM_UINT32, val);
+    return scalar<uint64_t>(NUM_UINT64, val);
+  }
+
+  Value negative_integer(int64_t val) {
+    if (!flags.unpack_narrow) return scalar<double>(NUM_DOUBLE, (double)val);
+    if ((int8_t)val == val) return scalar<int8_t>(NUM_INT8, val);
+    if ((int16_t)val == val) return scalar<int16_t>(NUM_INT16, val);
+    if ((int32_t)val == val) return scalar<int32_t>(NUM_INT32, val);
+    return scalar<int64_t>(NUM_INT64, val);
+  }
+
+  Value nil() {
+    switch (flags.unpack_nil) {
+      case UNPACK_NIL_NAN:
+        return scalar<double>(NUM_DOUBLE, std::numeric_limits<double>::quiet_NaN());
+      case UNPACK_NIL_EMPTY:
+        return b.create_empty();
+      case UNPACK_NIL_CELL:
+        return b.create_cell(0, 0);
+      default:  // UNPACK_NIL_ZERO
+        return scalar<double>(NUM_DOUBLE, 0);
+    }
+  }
+
+  Value bytes(const char* ptr, size_t n) {
+    void* data = NULL;
+    Value ret = b.create_numeric(NUM_UINT8, n, &data);
+    if (n) memcpy(data, ptr, n);
+    return ret;
+  }
+
+  Value str(const char* ptr, size_t n) {
+    if (n == 0) return b.create_char(NULL, 0);
+    if (flags.unicode_strs) return b.create_char(ptr, n);
+    // Unknown encoding. Just unpack to uint8
+    return bytes(ptr, n);
+  }
+
+  Value ext(const ExtPayload& ext) {
+    Value ret;
+    if (b.create_ext(ext, &ret)) return ret;
+    size_t type_cell = 0;
+    if (flags.unpack_ext_w_tag) {
+      ret = b.create_cell(1, 3);
+      b.set_cell(ret, 0, b.create_char("MSGPACK_EXT", 11));
+      type_cell++;
+    } else {
+      ret = b.create_cell(1, 2);
+    }
+    b.set_cell(ret, type_cell, scalar<double>(NUM_DOUBLE, ext.type));
+    b.set_cell(ret, type_cell + 1, bytes(ext.ptr, ext.size));
+    return ret;
+  }
+
+  void chunk_error() { b.error("msgpack:unpack_error", "Malformed chunked container."); }
+
+  // The limits on one array or str also hold for the total of a chunked one.
+  void check_joined(uint64_t total, bool is_array) {
+    if (total > (is_array ? limits.max_container_len : limits.max_str_len)) {
+      b.error("msgpack:limit_exceeded", is_array ? "Chunked array exceeds max_container_len."
+                                                 : "Chunked str, bin or ext exceeds max_str_len.");
+    }
+  }
+
+  // The payload of a str, bin or ext.
+  static size_t raw_bytes(const msgpack_object& obj, const char** ptr) {
+    switch (obj.type) {
+      case MSGPACK_OBJECT_STR: *ptr = obj.via.str.ptr; return obj.via.str.size;
+      case MSGPACK_OBJECT_BIN: *ptr = obj.via.bin.ptr; return obj.via.bin.size;
+      default: *ptr = obj.via.ext.ptr; return obj.via.ext.size;  // MSGPACK_OBJECT_EXT
+    }
+  }
+
+  // Unpack the n pieces of a chunked str, bin or ext (see EXT_CHUNKED) as one value of total
+  // bytes. The pieces must all be of one type (and ext code).
+  Value join_raw(const msgpack_object* chunks, size_t n, uint64_t total) {
+    msgpack_object_type type = chunks[0].type;
+    if (type != MSGPACK_OBJECT_STR && type != MSGPACK_OBJECT_BIN && type != MSGPACK_OBJECT_EXT)
+      chunk_error();
+    int8_t code = (type == MSGPACK_OBJECT_EXT) ? chunks[0].via.ext.type : 0;
+    uint64_t sum = 0;
+    const char* ptr = NULL;
+    for (size_t k = 0; k < n; k++) {
+      if (chunks[k].type != type || (type == MSGPACK_OBJECT_EXT && chunks[k].via.ext.type != code))
+        chunk_error();
+      sum += raw_bytes(chunks[k], &ptr);
+    }
+    if (sum != total) chunk_error();
+    check_joined(total, false);
+    joined.resize(total);
+    size_t pos = 0;
+    for (size_t k = 0; k < n; k++) {
+      size_t size = raw_bytes(chunks[k], &ptr);
+      if (size) memcpy(&joined[pos], ptr, size);
+      pos += size;
+    }
+    Value ret;
+    if (type == MSGPACK_OBJECT_STR) {
+      ret = str(joined.data(), total);
+    } else if (type == MSGPACK_OBJECT_BIN) {
+      ret = bytes(joined.data(), total);
+    } else {
+      ExtPayload ext = {code, joined.data(), total};
+      ret = this->ext(ext);
+    }
+    vector<char>().swap(joined);
+    return ret;
+  }
+
+  // Copy the n values of one scalar type into a new row of class cls. nils become nil_val, or are
+  // left out if skip_nils is set.
+  template <class T, class Elems, class Get>
+  Value fill_row(NumClass cls, const Elems& elems, size_t n, const vector<bool>& nils,
+                 size_t nnils, bool skip_nils, T nil_val, Get get) {
+    size_t nskip = skip_nils ? nnils : 0;
+    void* data = NULL;
+    Value ret = b.create_numeric(cls, n - nskip, &data);
+    T* ptr = (T*)data;
+    if (!nnils) {
+      for (size_t i = 0; i < n; i++) ptr[i] = get(elems[i]);
+    } else {
+      size_t ptr_i = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (!nils[i]) ptr[ptr_i++] = get(elems[i]);
+        else if (!nskip) ptr[ptr_i++] = nil_val;
+      }
+    }
+    return ret;
+  }
+
+  // Whether n strs with nnils nils among them can be one cellstr or string array (see str_elems).
+  // nils always keep their place: as empty strings with +unpack_nil_zero, or as <missing> in a
+  // string array with +unpack_nil_NaN. Any other nil has to go in a cell array.
+  bool str_elems_ok(size_t nnils) const {
+    return !nnils || flags.unpack_nil == UNPACK_NIL_ZERO ||
+           (flags.unpack_nil == UNPACK_NIL_NAN && flags.unpack_str_array_as_string);
+  }
+
+  // Unpack n strs (and nils, see str_elems_ok) as a 1xN cellstr, or a string array with
+  // +unpack_str_array_as_string. The cells are decoded straight from the msgpack bytes.
+  template <class Elems>
+  Value str_elems(const Elems& elems, size_t n, const vector<bool>& nils) {
+    Value ret = b.create_cell(1, n);
+    bool nil_nan = (flags.unpack_nil == UNPACK_NIL_NAN);
+    for (size_t i = 0; i < n; i++) {
+      if (!nils[i]) {
+        b.set_cell(ret, i, b.create_char(elems[i].via.str.ptr, elems[i].via.str.size));
+      } else if (nil_nan) {
+        // A NaN cell becomes <missing> in the string array
+        void* data = NULL;
+        Value nan = b.create_numeric(NUM_DOUBLE, 1, &data);
+        *(double*)data = std::numeric_limits<double>::quiet_NaN();
+        b.set_cell(ret, i, nan);
+      } else {
+        b.set_cell(ret, i, b.create_char(NULL, 0));
+      }
+    }
+    if (flags.unpack_str_array_as_string) ret = b.to_string_array(ret);
+    return ret;
+  }
+
+  // Unpack n objects as one array if they allow it: a single-type row if they are all scalars of
+  // one type (subject to the nil flags), a cellstr or string array if they are all strs (see
+  // str_elems), and [] if n is 0. Returns false if they have to be a cell array. skip_nils is
+  // +unpack_nil_array_skip, except where every element must keep its place.
+  template <class Elems>
+  bool typed_row(const Elems& elems, size_t n, bool skip_nils, Value* out) {
+    // Short circuit--empty array returns [];
+    if (n == 0) {
+      *out = b.create_empty();
+      return true;
+    }
+    // Figure out if the array is all of one scalar type, (or one type with nils)
+    int unique_scalar_type = -1;  // msgpack_object_type
+    bool one_scalar_type = true;
+    vector<bool> nils(n, false);
+    size_t nnils = 0;
+    for (size_t i = 0; i < n; i++) {
+      int this_type = elems[i].type;
+      if (this_type == MSGPACK_OBJECT_NIL) {
+        nils[i] = true;
+        nnils++;
+        continue;
+      }
+      if (unique_scalar_type > -1) {  // At least one scalar type has been found
+        if (this_type != unique_scalar_type) {
+          // Different type. Can't make an array.
+          one_scalar_type = false;
+          break;
+        }
+      } else if ((this_type > 0x00 && (this_type < 0x05 || this_type == 0x0a)) ||
+                 (this_type == MSGPACK_OBJECT_STR && flags.unicode_strs)) {
+        // Found a scalar non-nil type (a UTF-8 str counts as one)
+        unique_scalar_type = this_type;
+      } else {
+        // Non-scalar type. Can't make an array.
+        one_scalar_type = false;
+        break;
+      }
+    }
+    bool all_nils = (nnils == n);
+    bool any_nils = (nnils > 0);
+    if (one_scalar_type && unique_scalar_type == MSGPACK_OBJECT_STR) {
+      if (!str_elems_ok(nnils)) return false;
+      *out = str_elems(elems, n, nils);
+      return true;
+    }
+
+    // Single-type array if...
+    // - All scalar of same type and no nills
+    // - All scalar of same type and skip nil
+    // - All scalar of same type and nil-->zero
+    // - All scalar of float/double type and nil-->NaN
+    // - All nil and (nil-->Nan or nil-->zero)
+    // ...otherwise cell array
+    bool nil_nan = (flags.unpack_nil == UNPACK_NIL_NAN);
+    if (!((one_scalar_type &&
+           (!any_nils ||
+            skip_nils ||
+            flags.unpack_nil == UNPACK_NIL_ZERO ||
+            (nil_nan && (unique_scalar_type == MSGPACK_OBJECT_FLOAT32 ||
+                         unique_scalar_type == MSGPACK_OBJECT_FLOAT64)))) ||
+          (all_nils && (nil_nan || flags.unpack_nil == UNPACK_NIL_ZERO))))
+      return false;
+    void* data = NULL;
+    // First handle the three all-nil cases.
+    if (all_nils) {
+      if (skip_nils) {
+        *out = b.create_empty();
+      } else if (!nil_nan) {
+        *out = b.create_numeric(NUM_UINT8, n, &data);
+      } else {
+        *out = b.create_numeric(NUM_DOUBLE, n, &data);
+        std::fill((double*)data, (double*)data + n, std::numeric_limits<double>::quiet_NaN());
+      }
+      return true;
+    }
+    // Ok, there are between 0 and n-1 nils.
+    double nil_f = nil_nan ? std::numeric_limits<double>::quiet_NaN() : 0;
+    switch (unique_scalar_type) {
+      case MSGPACK_OBJECT_BOOLEAN:
+        *out = fill_row<bool>(NUM_LOGICAL, elems, n, nils, nnils, skip_nils, false,
+                              [](const msgpack_object& o) {return o.via.boolean;});
+        break;
+      case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        *out = fill_row<uint64_t>(NUM_UINT64, elems, n, nils, nnils, skip_nils, 0,
+                                  [](const msgpack_object& o) {return o.via.u64;});
+        break;
+      case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+        *out = fill_row<int64_t>(NUM_INT64, elems, n, nils, nnils, skip_nils, 0,
+                                 [](const msgpack_object& o) {return o.via.i64;});
+        break;
+      case MSGPACK_OBJECT_FLOAT32:
+        *out = fill_row<float>(NUM_SINGLE, elems, n, nils, nnils, skip_nils, (float)nil_f,
+                               [](const msgpack_object& o) {return (float)o.via.f64;});
+        break;
+      default:  // MSGPACK_OBJECT_FLOAT64
+        *out = fill_row<double>(NUM_DOUBLE, elems, n, nils, nnils, skip_nils, nil_f,
+                                [](const msgpack_object& o) {return o.via.f64;});
+    }
+    return true;
+  }
+};
+
+// Unpacks msgpack_object trees into Builder values. Used for unpack_schema and +unpack_records,
+// which need to look ahead at whole subtrees.
+template <class Builder>
+class ObjectUnpacker : public UnpackRules<Builder> {
+ public:
+  typedef typename Builder::Value Value;
+
+  ObjectUnpacker(Builder& builder, const mp_flags& flags, const mp_limits& limits)
+      : UnpackRules<Builder>(builder, flags, limits), depth(0) {}
+
+  // Forget frames left behind by an unpack that was aborted by an error.
+  void reset() {
+    stack.clear();
+    vector<char>().swap(this->joined);
+  }
+
+  // Unpack obj and everything below it. Containers push frames instead of recursing; this loop
+  // fills them in depth-first.
+  Value unpack(const msgpack_object& obj) {
+    size_t base = stack.size();
+    size_t saved_depth = depth;
+    depth = 0;
+    Value ret = node(obj);
+    while (stack.size() > base) {
+      Frame& frame = stack.back();
+      if (frame.i == frame.n) {
+        stack.pop_back();
+        continue;
+      }
+      size_t i = frame.i++;
+      Value parent = frame.ret;
+      bool is_field = (frame.kind == FRAME_FIELDS);
+      depth = frame.depth;
+      // May push frames, invalidating `frame`.
+      Value child = node(frame_child(frame, i));
+      if (is_field)
+        b.set_field(parent, i, child);
+      else
+        b.set_cell(parent, i, child);
+    }
+    depth = saved_depth;
+    return ret;
+  }
+
+ private:
+  struct Frame {
+    UnpackFrameKind kind;
+    Value ret;
+    const msgpack_object* elems;
+    const msgpack_object_kv* kvs;
+    uint32_t key;
+    size_t i, n;
+    size_t depth;
+  };
+
+  using UnpackRules<Builder>::b;
+  using UnpackRules<Builder>::flags;
+  vector<Frame> stack;
+  size_t depth;  // Depth of the container whose child is being unpacked
+
+  void push_frame(UnpackFrameKind kind, Value ret, const msgpack_object* elems,
+                  const msgpack_object_kv* kvs, uint32_t key, size_t n) {
+    if (n == 0) return;
+    this->check_depth(depth);
+    Frame frame = {kind, ret, elems, kvs, key, 0, n, depth + 1};
+    stack.push_back(frame);
+  }
+
+  static const msgpack_object& frame_child(const Frame& frame, size_t i) {
+    switch (frame.kind) {
+      case FRAME_CELLS:
+        return frame.elems[i];
+      case FRAME_CHUNKS:
+        return frame.elems[i / frame.key].via.array.ptr[i % frame.key];
+      case FRAME_RECORD_COLUMN:
+        return frame.elems[i].via.map.ptr[frame.key].val;
+      case FRAME_FIELDS:
+        return frame.kvs[i].val;
+      default:  // FRAME_MAP_CELLS
+        return (i % 2) ? frame.kvs[i / 2].val : frame.kvs[i / 2].key;
+    }
+  }
+
+  Value node(const msgpack_object& obj) {
+    switch (obj.type) {
+      case MSGPACK_OBJECT_ARRAY:
+        return array(obj);
+      case MSGPACK_OBJECT_MAP:
+        return map(obj);
+      default:
+        return this->leaf(obj);
+    }
+  }
+
+  Value map(const msgpack_object& obj) {
+    uint32_t nfields = obj.via.map.size;
+    bool all_strs = true;
+    for (size_t i = 0; i < nfields; i++) {
+      if (obj.via.map.ptr[i].key.type != MSGPACK_OBJECT_STR) {
+        all_strs = false;
+        if (!flags.unpack_map_as_cells)
+          b.warning("msgpack:non_str_map_keys", "Map has non-str keys. Unpacking as 2xN cells");
+        break;
+      }
+    }
+    Value ret;
+    if (all_strs && !flags.unpack_map_as_cells) {
+      // All str map keys. Unpack as struct
+      vector<string> names(nfields);
+      for (size_t i = 0; i < nfields; i++)
+        names[i].assign(obj.via.map.ptr[i].key.via.str.ptr, obj.via.map.ptr[i].key.via.str.size);
+      ret = b.create_struct(names);
+      // Field i holds value i (field names are unique or create_struct would have failed).
+      push_frame(FRAME_FIELDS, ret, NULL, obj.via.map.ptr, 0, nfields);
+    } else {
+      // unpack as cells. Column-major, so key i is cell 2*i and its value is cell 2*i+1.
+      ret = b.create_cell(2, nfields);
+      push_frame(FRAME_MAP_CELLS, ret, NULL, obj.via.map.ptr, 0, 2 * (size_t)nfields);
+    }
+    return ret;
+  }
+
+  Value array(const msgpack_object& obj) {
+    if (flags.unpack_records && is_records(obj)) return records(obj);
+    uint64_t total = 0;
+    if (is_chunked(obj, &total)) return chunked(obj, total);
+    ArrayElems elems = {obj.via.array.ptr, 0};
+    return array_elems(elems, obj.via.array.size, flags.unpack_nil_array_skip);
+  }
+
+  // Unpack a chunked container (see EXT_CHUNKED) as if its pieces were one array, str, bin or ext.
+  Value chunked(const msgpack_object& obj, uint64_t total) {
+    const msgpack_object* chunks = obj.via.array.ptr + 1;
+    size_t nchunks = obj.via.array.size - 1;
+    if (chunks[0].type != MSGPACK_OBJECT_ARRAY) return this->join_raw(chunks, nchunks, total);
+    this->check_joined(total, true);
+    ChunkedElems elems;
+    if (!chunked_array_elems(chunks, nchunks, total, &elems)) this->chunk_error();
+    return array_elems(elems, total, flags.unpack_nil_array_skip);
+  }
+
+  // True if obj is a non-empty array of maps that all have the same str keys in the same order.
+  static bool is_records(const msgpack_object& obj) {
+    if (obj.via.array.size == 0) return false;
+    const msgpack_object& first = obj.via.array.ptr[0];
+    if (first.type != MSGPACK_OBJECT_MAP || first.via.map.size == 0) return false;
+    uint32_t nkeys = first.via.map.size;
+    for (uint32_t j = 0; j < nkeys; j++) {
+      if (first.via.map.ptr[j].key.type != MSGPACK_OBJECT_STR) return false;
+    }
+    for (uint32_t i = 1; i < obj.via.array.size; i++) {
+      const msgpack_object& elem = obj.via.array.ptr[i];
+      if (elem.type != MSGPACK_OBJECT_MAP || elem.via.map.size != nkeys) return false;
+      for (uint32_t j = 0; j < nkeys; j++) {
+        const msgpack_object& key = elem.via.map.ptr[j].key;
+        const msgpack_object& first_key = first.via.map.ptr[j].key;
+        if (key.type != MSGPACK_OBJECT_STR || key.via.str.size != first_key.via.str.size ||
+            memcmp(key.via.str.ptr, first_key.via.str.ptr, key.via.str.size) != 0)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Unpack an array of same-keyed maps to a single struct of columns. Each column follows the same
+  // rules as an array, so numeric columns come out as dense row vectors, except that nils are never
+  // skipped: every column has one element per record.
+  Value records(const msgpack_object& obj) {
+    const msgpack_object& first = obj.via.array.ptr[0];
+    uint32_t nkeys = first.via.map.size;
+    size_t nrecords = obj.via.array.size;
+    vector<string> names(nkeys);
+    for (uint32_t j = 0; j < nkeys; j++)
+      names[j].assign(first.via.map.ptr[j].key.via.str.ptr, first.via.map.ptr[j].key.via.str.size);
+    Value ret = b.create_struct(names);
+    for (uint32_t j = 0; j < nkeys; j++) {
+      RecordColumn column = {obj.via.array.ptr, j};
+      b.set_field(ret, j, array_elems(column, nrecords, false));
+    }
+    return ret;
+  }
+
+  // Unpack n objects as one array (see typed_row), or else as a cell array.
+  template <class Elems>
+  Value array_elems(const Elems& elems, size_t n, bool skip_nils) {
+    Value ret;
+    if (this->typed_row(elems, n, skip_nils, &ret)) return ret;
+    // Unpack to cell array
+    ret = b.create_cell(1, n);
+    push_frame(Elems::kind, ret, elems.base, NULL, elems.key, n);
+    return ret;
+  }
+};
+
+// Unpacks one message straight from its bytes, without a msgpack_object tree, following the same
+// rules as ObjectUnpacker (but not +unpack_records). The bytes are read once.
+//
+// An array of 16 or more elements whose first element is a bool or number is filled speculatively:
+// a row of the type's class is created at the length from the array header and each element is
+// stored as it is read. Only a nil or a different type ends the speculation, and then the elements
+// are moved to a scratch buffer of leaves (msgpack_objects pointing into the input), which becomes
+// a typed row, a cellstr or cells by the usual rules when the array ends. The first array or map
+// inside an array turns it into a cell array on the spot, so the scratch buffer only holds the
+// innermost open array. Maps keep their keys and values on a stack until they end, when it is known
+// whether they become a struct or 2xN cells. A chunked container (see EXT_CHUNKED) is read as the
+// single array, str, bin or ext it was split from: the headers of its pieces are skipped as they
+// come up.
+//
+// Shorter arrays go straight to scratch. Creating a row only to drop it costs more than they save.
+static const size_t SPECULATIVE_ROW_MIN = 16;
+
+template <class Builder>
+class StreamUnpacker : public UnpackRules<Builder> {
+ public:
+  typedef typename Builder::Value Value;
+
+  StreamUnpacker(Builder& builder, const mp_flags& flags, const mp_limits& limits)
+      : UnpackRules<Builder>(builder, flags, limits) {}
+
+  // Forget state left behind by an unpack that was aborted by an error.
+  void reset() {
+    stack.clear();
+    scratch.clear();
+    slots.clear();
+    tree.clear();
+    vector<char>().swap(this->joined);
+  }
+
+  // Read the object at data[*offset] without unpacking it and advance *offset past it: all of a
+  // leaf, or only the header of an array or map, whose item count goes to *n. For callers that walk
+  // the outer levels of a message themselves.
+  void read_header(const char* data, size_t size, size_t* offset, msgpack_object* obj, size_t* n) {
+    pos = (const uint8_t*)data + *offset;
+    end = (const uint8_t*)data + size;
+    *n = 0;
+    read_object(obj, n);
+    *offset = pos - (const uint8_t*)data;
+  }
+
+  // Parse the message at data[*offset] into a msgpack_object tree allocated from zone, like
+  // msgpack_unpack_next, and advance *offset past it. Strs, bins and exts point into data. For
+  // ObjectUnpacker, which needs whole subtrees to look ahead. Containers are filled from an
+  // explicit stack, so nesting is bounded by the pre-scan's max_depth alone and not by the C stack
+  // or msgpack-c's MSGPACK_EMBED_STACK_SIZE.
+  msgpack_object read_tree(const char* data, size_t size, size_t* offset, msgpack_zone* zone) {
+    pos = (const uint8_t*)data + *offset;
+    end = (const uint8_t*)data + size;
+    tree.clear();
+    msgpack_object root;
+    msgpack_object* dst = &root;
+    while (true) {
+      size_t n = 0;
+      read_object(dst, &n);
+      if (dst->type == MSGPACK_OBJECT_ARRAY || dst->type == MSGPACK_OBJECT_MAP) {
+        // n fits in uint32_t: it came from a msgpack header
+        bool is_map = (dst->type == MSGPACK_OBJECT_MAP);
+        void* items = NULL;
+        if (n) {
+          items = msgpack_zone_malloc(zone, n * (is_map ? sizeof(msgpack_object_kv)
+                                                        : sizeof(msgpack_object)));
+          if (!items) b.error("msgpack:unpack_error", "Out of memory for the message tree.");
+          TreeFrame frame = {is_map ? NULL : (msgpack_object*)items,
+                             is_map ? (msgpack_object_kv*)items : NULL, 0, is_map ? 2 * n : n};
+          tree.push_back(frame);
+        }
+        if (is_map) {
+          dst->via.map.size = n;
+          dst->via.map.ptr = (msgpack_object_kv*)items;
+        } else {
+          dst->via.array.size = n;
+          dst->via.array.ptr = (msgpack_object*)items;
+        }
+      }
+      while (!tree.empty() && tree.back().i == tree.back().n) tree.pop_back();
+      if (tree.empty()) break;
+      TreeFrame& frame = tree.back();
+      size_t i = frame.i++;
+      if (frame.elems) dst = &frame.elems[i];
+      else dst = (i % 2) ? &frame.kvs[i / 2].val : &frame.kvs[i / 2].key;
+    }
+    *offset = pos - (const uint8_t*)data;
+    return root;
+  }
+
+  // Unpack the message starting at data[*offset] and advance *offset past it. The message must be
+  // complete; malformed or truncated bytes raise msgpack:unpack_error.
+  Value unpack(const char* data, size_t size, size_t* offset) {
+    pos = (const uint8_t*)data + *offset;
+    end = (const uint8_t*)data + size;
+    size_t base = stack.size();
+    while (true) {
+      msgpack_object obj;
+      Value v = Value();
+      bool is_value = false;  // v is a finished container rather than obj a leaf
+      if (stack.size() > base && stack.back().kind == STREAM_ROW && read_row(stack.back())) {
+        v = close(base);
+        is_value = true;
+      } else {
+        if (stack.size() > base && stack.back().i == stack.back().chunk_end)
+          next_chunk(stack.back());
+        size_t n = 0;
+        read_object(&obj, &n);
+        if (obj.type == MSGPACK_OBJECT_ARRAY || obj.type == MSGPACK_OBJECT_MAP) {
+          if (stack.size() > base && stack.back().kind == STREAM_ROW) to_cells(base);
+          bool is_map = (obj.type == MSGPACK_OBJECT_MAP);
+          if (n) {
+            if (is_map) this->check_depth(stack.size() - base);
+            size_t nitems = is_map ? 2 * n : n;
+            Frame frame = {is_map ? STREAM_MAP : STREAM_ROW, Value(), 0, nitems, slots.size(),
+                           true, -1, NULL, 0, nitems, 0};
+            stack.push_back(frame);
+            continue;
+          }
+          if (is_map && !flags.unpack_map_as_cells) v = b.create_struct(vector<string>());
+          else if (is_map) v = b.create_cell(2, 0);
+          else v = b.create_empty();
+          is_value = true;
+        }
+      }
+      // Hand the value up, closing every container it completes. Rows read their own leaves and
+      // become cells before taking a container, so only cells and maps are left here.
+      while (true) {
+        if (stack.size() == base) {
+          *offset = pos - (const uint8_t*)data;
+          return is_value ? v : this->leaf(obj);
+        }
+        Frame& frame = stack.back();
+        size_t i = frame.i++;
+        if (frame.kind == STREAM_CELLS) {
+          b.set_cell(frame.ret, i, is_value ? v : this->leaf(obj));
+        } else {
+          if (i % 2 == 0 && (is_value || obj.type != MSGPACK_OBJECT_STR) && frame.all_strs) {
+            frame.all_strs = false;
+            if (!flags.unpack_map_as_cells)
+              b.warning("msgpack:non_str_map_keys", "Map has non-str keys. Unpacking as 2xN cells");
+          }
+          Slot slot = {v, obj, is_value};
+          slots.push_back(slot);
+        }
+        if (frame.i < frame.n) break;
+        v = close(base);
+        is_value = true;
+      }
+    }
+  }
+
+ private:
+  enum StreamFrameKind {
+    STREAM_ROW,    // An array of leaves so far, in row or in scratch
+    STREAM_CELLS,  // Element i -> cell i of ret
+    STREAM_MAP,    // Keys and values are in slots[base...]
+    STREAM_JOINED  // A chunked str, bin or ext, already unpacked to ret
+  };
+
+  struct Frame {
+    StreamFrameKind kind;
+    Value ret;       // The cells, or the speculative row
+    size_t i, n;     // Next item and item count (2 per map pair)
+    size_t base;     // First slot of a map
+    bool all_strs;   // Map keys so far are all strs
+    int row_type;    // msgpack_object_type of every element of the speculative row, or -1
+    void* row_data;  // Elements of the speculative row
+    size_t chunks;     // Pieces of a chunked array still to come
+    size_t chunk_end;  // Item that starts the next piece (n if the array isn't chunked)
+    size_t chunk_len;  // Length of the first piece, or 0
+  };
+
+  // A container of read_tree whose items are still to be read.
+  struct TreeFrame {
+    msgpack_object* elems;   // Array elements, or NULL for a map
+    msgpack_object_kv* kvs;  // Map pairs
+    size_t i, n;             // Next item and item count (2 per map pair)
+  };
+
+  // A map key or value: a leaf still to be unpacked, or a finished container.
+  struct Slot {
+    Value v;
+    msgpack_object obj;
+    bool is_value;
+  };
+
+  using UnpackRules<Builder>::b;
+  using UnpackRules<Builder>::flags;
+  vector<Frame> stack;
+  vector<msgpack_object> scratch;
+  vector<Slot> slots;
+  vector<TreeFrame> tree;
+  const uint8_t* pos;
+  const uint8_t* end;
+
+  // Read leaves into the array on top of the stack. Returns true once it is full, or false if the
+  // next element is an array or map.
+  bool read_row(Frame& frame) {
+    while (frame.i < frame.n) {
+      if (frame.i == frame.chunk_end) next_chunk(frame);
+      need(1);
+      uint8_t c = *pos;
+      if ((c >= 0x80 && c <= 0x9f) || (c >= 0xdc && c <= 0xdf)) return false;
+      msgpack_object obj;
+      size_t n = 0;
+      read_object(&obj, &n);
+      size_t i = frame.i++;
+      if (i == 0) {
+        uint64_t total = 0;
+        if (!frame.chunk_len && is_chunk_marker(obj, &total) && chunks_fit(frame.n - 1, total)) {
+          start_chunks(frame, total);
+          continue;
+        }
+        if (frame.n >= SPECULATIVE_ROW_MIN) start_row(frame, obj.type);
+      }
+      if (obj.type == frame.row_type) {
+        switch (obj.type) {
+          case MSGPACK_OBJECT_BOOLEAN: ((bool*)frame.row_data)[i] = obj.via.boolean; break;
+          case MSGPACK_OBJECT_POSITIVE_INTEGER: ((uint64_t*)frame.row_data)[i] = obj.via.u64; break;
+          case MSGPACK_OBJECT_NEGATIVE_INTEGER: ((int64_t*)frame.row_data)[i] = obj.via.i64; break;
+          case MSGPACK_OBJECT_FLOAT32: ((float*)frame.row_data)[i] = (float)obj.via.f64; break;
+          default: ((double*)frame.row_data)[i] = obj.via.f64;  // MSGPACK_OBJECT_FLOAT64
+        }
+        continue;
+      }
+      if (frame.row_type >= 0) to_scratch(frame, i);
+      if (scratch.empty()) scratch.reserve(frame.n);
+      scratch.push_back(obj);
+    }
+    return true;
+  }
+
+  // Whether the nchunks objects at pos are the pieces of a chunked container of total length (see
+  // ChunkShape). Looks ahead without moving pos: each piece is skipped with a pre-scan, so a
+  // chunked array is walked twice. Pieces that are truncated or malformed don't fit; reading them
+  // as plain data then raises the error.
+  bool chunks_fit(size_t nchunks, uint64_t total) {
+    mp_limits unlimited;
+    unlimited.max_depth = SIZE_MAX;
+    const uint8_t* start = pos;
+    ChunkShape shape(total);
+    bool ok = nchunks > 0;
+    for (size_t k = 0; k < nchunks && ok; k++) {
+      PrescanStats stats;
+      const uint8_t* piece = pos;
+      if (prescan_message((const char*)piece, end - piece, unlimited, &stats) != PRESCAN_OK) {
+        ok = false;
+        break;
+      }
+      msgpack_object obj;
+      size_t n = 0;
+      read_object(&obj, &n);
+      ok = shape.add(obj, obj.type == MSGPACK_OBJECT_ARRAY ? n : chunk_piece_len(obj));
+      pos = piece + stats.bytes;
+    }
+    pos = start;
+    return ok && shape.complete();
+  }
+
+  // The array on top of the stack starts with a chunk marker and pieces that fit it. Read the rest
+  // of it as the array, str, bin or ext it was split from: an array takes the total length and
+  // skips the headers of its pieces as it goes, while the pieces of a str, bin or ext are read and
+  // joined here.
+  void start_chunks(Frame& frame, uint64_t total) {
+    size_t nchunks = frame.n - 1;
+    frame.i = 0;
+    frame.n = 0;
+    need(1);
+    uint8_t c = *pos;
+    if ((c >= 0x90 && c <= 0x9f) || c == 0xdc || c == 0xdd) {
+      this->check_joined(total, true);
+      frame.n = total;
+      frame.chunks = nchunks;
+      frame.chunk_end = 0;
+      return;
+    }
+    for (size_t k = 0; k < nchunks; k++) {
+      msgpack_object obj;
+      size_t n = 0;
+      read_object(&obj, &n);
+      scratch.push_back(obj);
+    }
+    frame.kind = STREAM_JOINED;
+    frame.ret = this->join_raw(scratch.data(), nchunks, total);
+    scratch.clear();
+  }
+
+  // Read the header of the next piece of the chunked array on top of the stack. The pieces must
+  // add up to the total, and all but the last have the length of the first.
+  void next_chunk(Frame& frame) {
+    if (frame.chunks == 0) this->chunk_error();
+    msgpack_object obj;
+    size_t n = 0;
+    read_object(&obj, &n);
+    if (obj.type != MSGPACK_OBJECT_ARRAY || n == 0 || n > frame.n - frame.i ||
+        (frame.i && (frame.i % frame.chunk_len || n > frame.chunk_len)))
+      this->chunk_error();
+    if (frame.i == 0) frame.chunk_len = n;
+    frame.chunks--;
+    frame.chunk_end = frame.i + n;
+  }
+
+  // Start a speculative row if elements of this type make one. The class is the one typed_row gives
+  // the type, so a row that fills up is the value typed_row would have made.
+  void start_row(Frame& frame, msgpack_object_type type) {
+    NumClass cls;
+    switch (type) {
+      case MSGPACK_OBJECT_BOOLEAN: cls = NUM_LOGICAL; break;
+      case MSGPACK_OBJECT_POSITIVE_INTEGER: cls = NUM_UINT64; break;
+      case MSGPACK_OBJECT_NEGATIVE_INTEGER: cls = NUM_INT64; break;
+      case MSGPACK_OBJECT_FLOAT32: cls = NUM_SINGLE; break;
+      case MSGPACK_OBJECT_FLOAT64: cls = NUM_DOUBLE; break;
+      default: return;
+    }
+    frame.ret = b.create_numeric(cls, frame.n, &frame.row_data);
+    frame.row_type = type;
+  }
+
+  // End the speculation on the row on top of the stack: move its first count elements to scratch.
+  void to_scratch(Frame& frame, size_t count) {
+    scratch.reserve(frame.n);
+    msgpack_object obj;
+    obj.type = (msgpack_object_type)frame.row_type;
+    for (size_t k = 0; k < count; k++) {
+      switch (frame.row_type) {
+        case MSGPACK_OBJECT_BOOLEAN: obj.via.boolean = ((bool*)frame.row_data)[k]; break;
+        case MSGPACK_OBJECT_POSITIVE_INTEGER: obj.via.u64 = ((uint64_t*)frame.row_data)[k]; break;
+        case MSGPACK_OBJECT_NEGATIVE_INTEGER: obj.via.i64 = ((int64_t*)frame.row_data)[k]; break;
+        case MSGPACK_OBJECT_FLOAT32: obj.via.f64 = ((float*)frame.row_data)[k]; break;
+        default: obj.via.f64 = ((double*)frame.row_data)[k];  // MSGPACK_OBJECT_FLOAT64
+      }
+      scratch.push_back(obj);
+    }
+    b.destroy(frame.ret);
+    frame.ret = Value();
+    frame.row_type = -1;
+  }
+
+  // Turn the array on top of the stack into a cell array, unpacking the leaves read so far.
+  void to_cells(size_t base) {
+    Frame& frame = stack.back();
+    this->check_depth(stack.size() - 1 - base);
+    if (frame.row_type >= 0) to_scratch(frame, frame.i);
+    frame.kind = STREAM_CELLS;
+    frame.ret = b.create_cell(1, frame.n);
+    for (size_t i = 0; i < scratch.size(); i++) b.set_cell(frame.ret, i, this->leaf(scratch[i]));
+    scratch.clear();
+  }
+
+  // Pop the finished container on top of the stack and return its value.
+  Value close(size_t base) {
+    Frame frame = stack.back();
+    stack.pop_back();
+    if (frame.chunks) this->chunk_error();
+    Value ret;
+    if (frame.kind == STREAM_ROW) {
+      if (frame.row_type >= 0) return frame.ret;
+      ArrayElems elems = {scratch.data(), 0};
+      if (!this->typed_row(elems, frame.n, flags.unpack_nil_array_skip, &ret)) {
+        this->check_depth(stack.size() - base);
+        ret = b.create_cell(1, frame.n);
+        for (size_t i = 0; i < frame.n; i++) b.set_cell(ret, i, this->leaf(scratch[i]));
+      }
+      scratch.clear();
+    } else if (frame.kind == STREAM_CELLS || frame.kind == STREAM_JOINED) {
+      ret = frame.ret;
+    } else {
+      const Slot* kvs = &slots[frame.base];
+      size_t npairs = frame.n / 2;
+      if (frame.all_strs && !flags.unpack_map_as_cells) {
+        vector<string> names(npairs);
+        for (size_t i = 0; i < npairs; i++)
+          names[i].assign(kvs[2 * i].obj.via.str.ptr, kvs[2 * i].obj.via.str.size);
+        ret = b.create_struct(names);
+        for (size_t i = 0; i < npairs; i++) b.set_field(ret, i, slot_value(kvs[2 * i + 1]));
+      } else {
+        ret = b.create_cell(2, npairs);
+        for (size_t i = 0; i < frame.n; i++) b.set_cell(ret, i, slot_value(kvs[i]));
+      }
+      slots.resize(frame.base);
+    }
+    return ret;
+  }
+
+  Value slot_value(const Slot& slot) { return slot.is_value ? slot.v : this->leaf(slot.obj); }
+
+  void fail(const char* msg) { b.error("msgpack:unpack_error", msg); }
+
+  // Make sure n more bytes are available.
+  void need(size_t n) {
+    if ((size_t)(end - pos) < n) fail("Truncated message.");
+  }
+
+  // Big-endian unsigned int of width 1, 2, 4 or 8 bytes.
+  uint64_t read_be(size_t width) {
+    need(width);
+    const uint8_t* p = pos;
+    pos += width;
+    switch (width) {
+      case 1: return p[0];
+      case 2: return (uint64_t)p[0] << 8 | p[1];
+      case 4: return (uint64_t)p[0] << 24 | (uint64_t)p[1] << 16 | (uint64_t)p[2] << 8 | p[3];
+      default:
+        return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 |
+               (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+               (uint64_t)p[6] << 8 | p[7];
+    }
+  }
+
+  // Skip the next len bytes and return where they start.
+  const char* raw(size_t len) {
+    need(len);
+    const char* ptr = (const char*)pos;
+    pos += len;
+    return ptr;
+  }
+
+  void set_int(msgpack_object* obj, int64_t val) {
+    // Like msgpack-c, non-negative signed ints are positive integers.
+    obj->type = val < 0 ? MSGPACK_OBJECT_NEGATIVE_INTEGER : MSGPACK_OBJECT_POSITIVE_INTEGER;
+    obj->via.i64 = val;
+  }
+
+  void set_raw(msgpack_object* obj, msgpack_object_type type, size_t len) {
+    obj->type = type;
+    if (type == MSGPACK_OBJECT_BIN) {
+      obj->via.bin.size = len;
+      obj->via.bin.ptr = raw(len);
+    } else {
+      obj->via.str.size = len;
+      obj->via.str.ptr = raw(len);
+    }
+  }
+
+  void set_ext(msgpack_object* obj, size_t len) {
+    obj->type = MSGPACK_OBJECT_EXT;
+    obj->via.ext.type = (int8_t)read_be(1);
+    obj->via.ext.size = len;
+    obj->via.ext.ptr = raw(len);
+  }
+
+  // Read one object. For an array or map only the header is read, and *n is its item count.
+  void read_object(msgpack_object* obj, size_t* n) {
+    uint8_t c = (uint8_t)read_be(1);
+    if (c <= 0x7f) {
+      obj->type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+      obj->via.u64 = c;
+    } else if (c >= 0xe0) {
+      set_int(obj, (int8_t)c);
+    } else if (c <= 0x8f) {
+      obj->type = MSGPACK_OBJECT_MAP;
+      *n = c & 0x0f;
+    } else if (c <= 0x9f) {
+      obj->type = MSGPACK_OBJECT_ARRAY;
+      *n = c & 0x0f;
+    } else if (c <= 0xbf) {
+      set_raw(obj, MSGPACK_OBJECT_STR, c & 0x1f);
+    } else {
+      switch (c) {
+        case 0xc0: obj->type = MSGPACK_OBJECT_NIL; break;
+        case 0xc2: case 0xc3:
+          obj->type = MSGPACK_OBJECT_BOOLEAN;
+          obj->via.boolean = (c == 0xc3);
+          break;
+        case 0xc4: set_raw(obj, MSGPACK_OBJECT_BIN, read_be(1)); break;
+        case 0xc5: set_raw(obj, MSGPACK_OBJECT_BIN, read_be(2)); break;
+        case 0xc6: set_raw(obj, MSGPACK_OBJECT_BIN, read_be(4)); break;
+        case 0xc7: set_ext(obj, read_be(1)); break;
+        case 0xc8: set_ext(obj, read_be(2)); break;
+        case 0xc9: set_ext(obj, read_be(4)); break;
+        case 0xca: {
+          uint32_t bits = read_be(4);
+          float f;
+          memcpy(&f, &bits, 4);
+          obj->type = MSGPACK_OBJECT_FLOAT32;
+          obj->via.f64 = f;
+          break;
+        }
+        case 0xcb: {
+          uint64_t bits = read_be(8);
+          obj->type = MSGPACK_OBJECT_FLOAT64;
+          memcpy(&obj->via.f64, &bits, 8);
+          break;
+        }
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+          obj->type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+          obj->via.u64 = read_be((size_t)1 << (c - 0xcc));
+          break;
+        case 0xd0: set_int(obj, (int8_t)read_be(1)); break;
+        case 0xd1: set_int(obj, (int16_t)read_be(2)); break;
+        case 0xd2: set_int(obj, (int32_t)read_be(4)); break;
+        case 0xd3: set_int(obj, (int64_t)read_be(8)); break;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+          set_ext(obj, (size_t)1 << (c - 0xd4));
+          break;
+        case 0xd9: set_raw(obj, MSGPACK_OBJECT_STR, read_be(1)); break;
+        case 0xda: set_raw(obj, MSGPACK_OBJECT_STR, read_be(2)); break;
+        case 0xdb: set_raw(obj, MSGPACK_OBJECT_STR, read_be(4)); break;
+        case 0xdc: case 0xdd:
+          obj->type = MSGPACK_OBJECT_ARRAY;
+          *n = read_be(c == 0xdc ? 2 : 4);
+          break;
+        case 0xde: case 0xdf:
+          obj->type = MSGPACK_OBJECT_MAP;
+          *n = read_be(c == 0xde ? 2 : 4);
+          break;
+        default:  // 0xc1
+          fail("Invalid msgpack type byte 0xc1.");
+      }
+    }
+    // Every item takes at least a byte, so this also bounds the scratch reservation.
+    if (*n > (size_t)(end - pos)) fail("Truncated message.");
+  }
+};
+
+#endif /* MSGPACK_CORE_H */
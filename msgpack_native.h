@@ -0,0 +1,109 @@
+/*
+ * MessagePack for Matlab - in-memory values for the converter core
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* A Builder for msgpack_core.h that creates plain C++ stand-ins for the mxArrays the MEX file
+ * would return, so the core can be benchmarked, profiled and fuzzed without MATLAB. Values are
+ * owned by the builder and freed by clear(), much like mxArrays at the end of a MEX call. */
+
+#ifndef MSGPACK_NATIVE_H
+#define MSGPACK_NATIVE_H
+
+#include <memory>
+#include <stdexcept>
+
+#include "msgpack_core.h"
+
+struct NativeValue {
+  enum Kind {NATIVE_NUMERIC, NATIVE_CHAR, NATIVE_CELL, NATIVE_STRUCT};
+  Kind kind;
+  NumClass cls;                  // Class of a numeric row
+  size_t rows, cols;
+  vector<char> data;             // Numeric elements
+  vector<uint16_t> chars;        // UTF-16 code units of a char row
+  vector<NativeValue*> elems;    // Cells (column-major) or field values
+  vector<string> field_names;
+  bool is_string;                // A cellstr standing in for a MATLAB string array
+};
+
+struct NativeBuilder {
+  typedef NativeValue* Value;
+
+  vector<std::unique_ptr<NativeValue> > pool;
+  vector<string> warnings;  // ids of the warnings raised so far, in order
+  ExtCodec ext_codecs[256] = {};  // By ext code as uint8_t. Only the native kinds are decoded.
+
+  // Free every value created so far.
+  void clear() { pool.clear(); }
+
+  NativeValue* create(NativeValue::Kind kind, size_t rows, size_t cols) {
+    NativeValue* v = new NativeValue();
+    pool.push_back(std::unique_ptr<NativeValue>(v));
+    v->kind = kind;
+    v->cls = NUM_DOUBLE;
+    v->rows = rows;
+    v->cols = cols;
+    v->is_string = false;
+    return v;
+  }
+
+  NativeValue* create_numeric(NumClass cls, size_t n, void** data) {
+    NativeValue* v = create(NativeValue::NATIVE_NUMERIC, 1, n);
+    v->cls = cls;
+    v->data.resize(n * num_class_size[cls]);
+    *data = v->data.data();
+    return v;
+  }
+  NativeValue* create_empty() { return create(NativeValue::NATIVE_NUMERIC, 0, 0); }
+  NativeValue* create_char(const char* utf8, size_t n) {
+    NativeValue* v = create(NativeValue::NATIVE_CHAR, n ? 1 : 0, n);
+    if (n) {
+      v->chars.resize(n);
+      v->cols = utf8_to_utf16(utf8, n, v->chars.data());
+      v->chars.resize(v->cols);
+    }
+    return v;
+  }
+  NativeValue* create_cell(size_t rows, size_t cols) {
+    NativeValue* v = create(NativeValue::NATIVE_CELL, rows, cols);
+    v->elems.resize(rows * cols, NULL);
+    return v;
+  }
+  void set_cell(NativeValue* cell, size_t i, NativeValue* v) { cell->elems[i] = v; }
+  NativeValue* create_struct(const vector<string>& names) {
+    NativeValue* v = create(NativeValue::NATIVE_STRUCT, 1, 1);
+    v->field_names = names;
+    v->elems.resize(names.size(), NULL);
+    return v;
+  }
+  void set_field(NativeValue* s, size_t i, NativeValue* v) { s->elems[i] = v; }
+  NativeValue* to_string_array(NativeValue* cellstr) {
+    cellstr->is_string = true;
+    return cellstr;
+  }
+  bool create_ext(const ExtPayload& ext, NativeValue** out) {
+    return decode_ext(*this, ext_codecs[(uint8_t)ext.type], ext, out);
+  }
+  void destroy(NativeValue* v) { v->data.clear(); }  // The NativeValue itself goes with clear()
+  void error(const char* id, const char* msg) {
+    throw std::runtime_error(string(id) + ": " + msg);
+  }
+  void warning(const char* id, const char*) { warnings.push_back(id); }
+};
+
+#endif /* MSGPACK_NATIVE_H */
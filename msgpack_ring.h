@@ -0,0 +1,166 @@
+/*
+ * MessagePack for Matlab - shared-memory ring buffer layout
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* Single-producer/single-consumer ring of msgpack messages in POSIX shared memory, as used by
+ * msgpack('ring_open', ...). Include this from a C or C++ process to exchange messages with
+ * MATLAB.
+ *
+ * The shared memory object is a msgpack_ring header followed by `capacity` bytes of data. head and
+ * tail are running byte counts; the consumer only writes head and the producer only writes tail.
+ * Each record is an 8-byte header (uint32 payload length, uint32 reserved) followed by the payload
+ * padded to a multiple of 8 bytes. A record never wraps: if it doesn't fit before the end of the
+ * data area, the producer writes a MSGPACK_RING_WRAP length there and starts again at offset 0.
+ *
+ * Producer:  p = msgpack_ring_reserve(ring, len); <write len bytes to p>; msgpack_ring_commit(ring, len);
+ * Consumer:  p = msgpack_ring_peek(ring, &len); <read len bytes at p>; msgpack_ring_release(ring);
+ *
+ * The consumer doesn't trust the lengths it reads: a record that would run past the end of the
+ * data area or past the tail is malformed. msgpack_ring_peek then sets len to MSGPACK_RING_WRAP,
+ * and msgpack_ring_release drops everything up to the tail, since the next record can't be found.
+ */
+
+#ifndef MSGPACK_RING_H
+#define MSGPACK_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MSGPACK_RING_MAGIC 0x4752504du  /* "MPRG" */
+#define MSGPACK_RING_VERSION 1
+#define MSGPACK_RING_WRAP 0xffffffffu
+#define MSGPACK_RING_RECORD_HEADER 8
+
+typedef struct msgpack_ring {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;  /* Bytes in the data area, a multiple of 8 */
+  char pad0[48];
+  uint64_t head;      /* Bytes consumed. Written by the consumer only. */
+  char pad1[56];
+  uint64_t tail;      /* Bytes produced. Written by the producer only. */
+  char pad2[56];
+} msgpack_ring;
+
+static inline char* msgpack_ring_data(msgpack_ring* ring) {
+  return (char*)ring + sizeof(msgpack_ring);
+}
+
+static inline uint64_t msgpack_ring_record_size(uint32_t len) {
+  return MSGPACK_RING_RECORD_HEADER + (((uint64_t)len + 7) & ~(uint64_t)7);
+}
+
+/* Set up a freshly created, zeroed ring. capacity must be a multiple of 8. */
+static inline void msgpack_ring_init(msgpack_ring* ring, uint64_t capacity) {
+  ring->version = MSGPACK_RING_VERSION;
+  ring->capacity = capacity;
+  ring->head = 0;
+  ring->tail = 0;
+  __atomic_store_n(&ring->magic, MSGPACK_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Producer: the largest payload that can be written at the tail right now without wrapping. */
+static inline uint64_t msgpack_ring_writable(msgpack_ring* ring) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t free_bytes = ring->capacity - (ring->tail - head);
+  uint64_t contiguous = ring->capacity - ring->tail % ring->capacity;
+  uint64_t avail = (free_bytes < contiguous) ? free_bytes : contiguous;
+  return (avail > MSGPACK_RING_RECORD_HEADER) ? avail - MSGPACK_RING_RECORD_HEADER : 0;
+}
+
+/* Producer: where to write a payload of len bytes, wrapping to the start of the data area if
+ * needed. Returns NULL if the ring doesn't have room. */
+static inline char* msgpack_ring_reserve(msgpack_ring* ring, uint32_t len) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring->tail;
+  uint64_t offset = tail % ring->capacity;
+  uint64_t need = msgpack_ring_record_size(len);
+  uint64_t free_bytes = ring->capacity - (tail - head);
+  if (ring->capacity - offset < need) {
+    /* Wrap now even if the record doesn't fit yet: the space at the start only frees up once the
+     * consumer has passed the wrap marker. */
+    uint64_t skip = ring->capacity - offset;
+    uint32_t wrap = MSGPACK_RING_WRAP;
+    if (free_bytes < skip) return NULL;
+    memcpy(msgpack_ring_data(ring) + offset, &wrap, sizeof(wrap));
+    __atomic_store_n(&ring->tail, tail + skip, __ATOMIC_RELEASE);
+    free_bytes -= skip;
+    offset = 0;
+  }
+  if (free_bytes < need) return NULL;
+  return msgpack_ring_data(ring) + offset + MSGPACK_RING_RECORD_HEADER;
+}
+
+/* Producer: publish the len-byte payload written at the tail. */
+static inline void msgpack_ring_commit(msgpack_ring* ring, uint32_t len) {
+  char* record = msgpack_ring_data(ring) + ring->tail % ring->capacity;
+  uint32_t reserved = 0;
+  memcpy(record, &len, sizeof(len));
+  memcpy(record + sizeof(len), &reserved, sizeof(reserved));
+  __atomic_store_n(&ring->tail, ring->tail + msgpack_ring_record_size(len), __ATOMIC_RELEASE);
+}
+
+/* Producer: copy a whole message in. Returns 0 if the ring doesn't have room. */
+static inline int msgpack_ring_push(msgpack_ring* ring, const void* data, uint32_t len) {
+  char* ptr = msgpack_ring_reserve(ring, len);
+  if (!ptr) return 0;
+  memcpy(ptr, data, len);
+  msgpack_ring_commit(ring, len);
+  return 1;
+}
+
+/* Consumer: whether a record of len bytes at head fits in the data area and before tail. */
+static inline int msgpack_ring_record_ok(msgpack_ring* ring, uint64_t head, uint64_t tail,
+                                         uint32_t len) {
+  uint64_t size = msgpack_ring_record_size(len);
+  return size <= ring->capacity - head % ring->capacity && size <= tail - head;
+}
+
+/* Consumer: the oldest unread payload, read in place, or NULL if the ring is empty. If the record
+ * is malformed, *len is MSGPACK_RING_WRAP and the payload must not be read. */
+static inline const char* msgpack_ring_peek(msgpack_ring* ring, uint32_t* len) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = ring->head;
+  while (head != tail) {
+    uint64_t offset = head % ring->capacity;
+    const char* record = msgpack_ring_data(ring) + offset;
+    memcpy(len, record, sizeof(*len));
+    if (*len != MSGPACK_RING_WRAP) {
+      if (!msgpack_ring_record_ok(ring, head, tail, *len)) *len = MSGPACK_RING_WRAP;
+      return record + MSGPACK_RING_RECORD_HEADER;
+    }
+    head += ring->capacity - offset;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Consumer: done with the payload returned by msgpack_ring_peek. */
+static inline void msgpack_ring_release(msgpack_ring* ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = ring->head;
+  uint32_t len;
+  memcpy(&len, msgpack_ring_data(ring) + head % ring->capacity, sizeof(len));
+  if (len == MSGPACK_RING_WRAP || !msgpack_ring_record_ok(ring, head, tail, len))
+    head = tail;
+  else
+    head += msgpack_ring_record_size(len);
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+#endif /* MSGPACK_RING_H */
@@ -0,0 +1,108 @@
+/*
+ * MessagePack for Matlab - example producer for the shared-memory ring
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* Writes messages into a ring opened with msgpack('ring_open', name, ...), using only
+ * msgpack_ring.h. Used by test_ring.m.
+ *
+ *   cc -o msgpack_ring_producer msgpack_ring_producer.c -lrt
+ *   ./msgpack_ring_producer [--malformed | --bad-length] name count
+ *
+ * Pushes count messages [i, "msg i"] for i = 1..count, waiting while the ring is full. With
+ * --malformed, a record that isn't valid msgpack goes first; with --bad-length, a record header
+ * whose length runs past the end of the ring. Exits with status 1 on errors. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msgpack_ring.h"
+
+/* Encode [i, "msg i"] into buf and return its length. */
+static uint32_t encode_message(char* buf, uint32_t i) {
+  char text[32];
+  uint32_t n = (uint32_t)snprintf(text, sizeof(text), "msg %u", i);
+  buf[0] = (char)0x92;  /* fixarray of 2 */
+  buf[1] = (char)0xce;  /* uint32 */
+  buf[2] = (char)(i >> 24);
+  buf[3] = (char)(i >> 16);
+  buf[4] = (char)(i >> 8);
+  buf[5] = (char)i;
+  buf[6] = (char)(0xa0 | n);  /* fixstr */
+  memcpy(buf + 7, text, n);
+  return 7 + n;
+}
+
+static void push(msgpack_ring* ring, const char* data, uint32_t len) {
+  while (!msgpack_ring_push(ring, data, len)) usleep(1000);
+}
+
+int main(int argc, char** argv) {
+  int malformed = 0, bad_length = 0, arg = 1;
+  if (arg < argc && !strcmp(argv[arg], "--malformed")) {
+    malformed = 1;
+    arg++;
+  } else if (arg < argc && !strcmp(argv[arg], "--bad-length")) {
+    bad_length = 1;
+    arg++;
+  }
+  if (argc - arg != 2) {
+    fprintf(stderr, "Usage: %s [--malformed | --bad-length] name count\n", argv[0]);
+    return 2;
+  }
+  char name[256];
+  snprintf(name, sizeof(name), "%s%s", argv[arg][0] == '/' ? "" : "/", argv[arg]);
+  long count = atol(argv[arg + 1]);
+
+  int fd = shm_open(name, O_RDWR, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(msgpack_ring)) {
+    fprintf(stderr, "Can't open ring %s\n", name);
+    return 1;
+  }
+  msgpack_ring* ring = (msgpack_ring*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED || __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != MSGPACK_RING_MAGIC ||
+      ring->version != MSGPACK_RING_VERSION || ring->capacity < 64 || ring->capacity % 8 ||
+      ring->capacity > (uint64_t)st.st_size - sizeof(msgpack_ring)) {
+    fprintf(stderr, "%s is not an initialized msgpack ring\n", name);
+    return 1;
+  }
+
+  if (malformed) {
+    char bad = (char)0xc1;  /* never used in msgpack */
+    push(ring, &bad, 1);
+  }
+  if (bad_length) {
+    /* Publish just a header that claims more bytes than the whole ring */
+    while (!msgpack_ring_reserve(ring, 0)) usleep(1000);
+    char* record = msgpack_ring_data(ring) + ring->tail % ring->capacity;
+    uint32_t len = (uint32_t)ring->capacity;
+    memcpy(record, &len, sizeof(len));
+    __atomic_store_n(&ring->tail, ring->tail + MSGPACK_RING_RECORD_HEADER, __ATOMIC_RELEASE);
+  }
+  char buf[64];
+  for (long i = 1; i <= count; i++) push(ring, buf, encode_message(buf, (uint32_t)i));
+  munmap(ring, st.st_size);
+  return 0;
+}
@@ -0,0 +1,602 @@
+/*
+ * MessagePack for Matlab - native tests of the converter core
+ *
+ * msgpack-matlab2 modifications Copyright [2018] [ Randall Pittman <randallpittman@outlook.com> ]
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * */
+
+/* Checks the unpack rules of msgpack_core.h without MATLAB. Each case unpacks a message given as
+ * hex bytes through both the object tree path and the stream decoder, and compares a description
+ * of the result (see describe) with the expected one.
+ *
+ *   g++ -std=c++11 -o msgpack_test msgpack_test.cc -lmsgpack
+ *   ./msgpack_test [-n rounds] [-s seed]
+ *
+ * Then it unpacks random messages (truncated ones too) with random flags on both paths and checks
+ * that they give the same values, errors, warnings and offsets. -n sets the number of rounds and
+ * -s the random seed.
+ *
+ * Prints each failure and exits with status 1 if there were any. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+
+#include "msgpack_native.h"
+
+static mp_flags flags;
+static mp_limits limits;
+static ExtCodec ext_codecs[256] = {};  // Copied into each builder
+static int failures = 0;
+
+// A compact description of a value, e.g. "double[1.5 NaN]", "'abc'", "{uint64[1 2], 'x'}",
+// "string{'a', 'b'}", "{2x1: 'k', uint8[1]}" or "struct(t=uint64[1], x=[])".
+string describe(const NativeValue* v) {
+  char buf[64];
+  string s;
+  switch (v->kind) {
+    case NativeValue::NATIVE_NUMERIC:
+      if (!v->rows) return "[]";
+      s = string(num_class_names[v->cls]) + "[";
+      for (size_t i = 0; i < v->cols; i++) {
+        const char* p = v->data.data() + i * num_class_size[v->cls];
+        switch (v->cls) {
+          case NUM_LOGICAL: case NUM_UINT8: snprintf(buf, sizeof(buf), "%u", *(uint8_t*)p); break;
+          case NUM_INT8: snprintf(buf, sizeof(buf), "%d", *(int8_t*)p); break;
+          case NUM_INT16: snprintf(buf, sizeof(buf), "%d", *(int16_t*)p); break;
+          case NUM_UINT16: snprintf(buf, sizeof(buf), "%u", *(uint16_t*)p); break;
+          case NUM_INT32: snprintf(buf, sizeof(buf), "%d", *(int32_t*)p); break;
+          case NUM_UINT32: snprintf(buf, sizeof(buf), "%u", *(uint32_t*)p); break;
+          case NUM_INT64: snprintf(buf, sizeof(buf), "%lld", (long long)*(int64_t*)p); break;
+          case NUM_UINT64: snprintf(buf, sizeof(buf), "%llu", (unsigned long long)*(uint64_t*)p); break;
+          case NUM_SINGLE: snprintf(buf, sizeof(buf), "%g", *(float*)p); break;
+          default: snprintf(buf, sizeof(buf), "%g", *(double*)p);  // NUM_DOUBLE
+        }
+        s += (i ? " " : "") + string(strcmp(buf, "nan") && strcmp(buf, "-nan") ? buf : "NaN");
+      }
+      return s + "]";
+    case NativeValue::NATIVE_CHAR:
+      s = "'";
+      for (size_t i = 0; i < v->chars.size(); i++) {
+        if (v->chars[i] >= 0x20 && v->chars[i] < 0x7f) {
+          s += (char)v->chars[i];
+        } else {
+          snprintf(buf, sizeof(buf), "\\u%04x", v->chars[i]);
+          s += buf;
+        }
+      }
+      return s + "'";
+    case NativeValue::NATIVE_CELL:
+      s = v->is_string ? "string{" : "{";
+      if (v->rows != 1 && !v->elems.empty()) {
+        snprintf(buf, sizeof(buf), "%zux%zu: ", v->rows, v->cols);
+        s += buf;
+      }
+      for (size_t i = 0; i < v->elems.size(); i++) s += (i ? ", " : "") + describe(v->elems[i]);
+      return s + "}";
+    default:  // NATIVE_STRUCT
+      s = "struct(";
+      for (size_t i = 0; i < v->elems.size(); i++)
+        s += (i ? ", " : "") + v->field_names[i] + "=" + describe(v->elems[i]);
+      return s + ")";
+  }
+}
+
+string from_hex(const char* hex) {
+  string bytes;
+  unsigned byte;
+  int n;
+  while (sscanf(hex, " %2x%n", &byte, &n) == 1) {
+    bytes += (char)byte;
+    hex += n;
+  }
+  return bytes;
+}
+
+// " warning <id>" for each warning the builder raised, in order.
+string describe_warnings(const NativeBuilder& builder) {
+  string ret;
+  for (size_t i = 0; i < builder.warnings.size(); i++) ret += " warning " + builder.warnings[i];
+  return ret;
+}
+
+// Unpack one message with the object tree path, or describe the error it raised as "error <id>",
+// followed by the warnings it raised.
+string unpack_object(const string& bytes) {
+  NativeBuilder builder;
+  memcpy(builder.ext_codecs, ext_codecs, sizeof(ext_codecs));
+  ObjectUnpacker<NativeBuilder> unpacker(builder, flags, limits);
+  StreamUnpacker<NativeBuilder> reader(builder, flags, limits);
+  msgpack_zone* zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  string ret;
+  size_t offset = 0;
+  try {
+    ret = describe(unpacker.unpack(reader.read_tree(bytes.data(), bytes.size(), &offset, zone)));
+  } catch (const std::exception& e) {
+    ret = "error " + string(e.what()).substr(0, string(e.what()).find(':', 8));
+  }
+  msgpack_zone_free(zone);
+  return ret + describe_warnings(builder);
+}
+
+// As unpack_object, with the stream decoder.
+string unpack_stream(const string& bytes) {
+  NativeBuilder builder;
+  memcpy(builder.ext_codecs, ext_codecs, sizeof(ext_codecs));
+  StreamUnpacker<NativeBuilder> unpacker(builder, flags, limits);
+  size_t offset = 0;
+  string ret;
+  try {
+    ret = describe(unpacker.unpack(bytes.data(), bytes.size(), &offset));
+  } catch (const std::exception& e) {
+    ret = "error " + string(e.what()).substr(0, string(e.what()).find(':', 8));
+  }
+  return ret + describe_warnings(builder);
+}
+
+// Unpack the message in hex with the current flags and limits and check the result on both paths
+// (only the object tree path with +unpack_records, like the MEX file).
+void check(const char* hex, const char* expected) {
+  string bytes = from_hex(hex);
+  PrescanStats stats;
+  PrescanResult prescan = prescan_message(bytes.data(), bytes.size(), limits, &stats);
+  string got[2];
+  got[0] = prescan == PRESCAN_OK ? unpack_object(bytes) : "prescan " + std::to_string(prescan);
+  got[1] = prescan != PRESCAN_OK || flags.unpack_records ? got[0] : unpack_stream(bytes);
+  for (int k = 0; k < 2; k++) {
+    if (got[k] != expected) {
+      printf("FAIL %s (%s): expected %s, got %s\n", hex, k ? "stream" : "object", expected,
+             got[k].c_str());
+      failures++;
+    }
+  }
+}
+
+void test_rows() {
+  check("93 01 02 03", "uint64[1 2 3]");
+  check("93 ff fe 05", "{double[-1], double[-2], double[5]}");
+  check("92 c3 c2", "logical[1 0]");
+  check("92 ca 3f c0 00 00 ca c0 00 00 00", "single[1.5 -2]");
+  check("90", "[]");
+  // An array whose first element is a container is a cell, not an all-nil array
+  check("92 92 01 02 91 03", "{uint64[1 2], uint64[3]}");
+  check("93 c0 92 01 a1 61 c0", "{double[0], {double[1], 'a'}, double[0]}");
+}
+
+void test_scalars() {
+  check("ca 3f c0 00 00", "double[1.5]");
+  check("a3 61 62 63", "'abc'");
+  check("a2 c3 a9", "'\\u00e9'");
+  check("c4 02 01 02", "uint8[1 2]");
+  check("c0", "double[0]");
+  flags.unpack_narrow = true;
+  check("ca 3f c0 00 00", "single[1.5]");
+  check("cb 3f f8 00 00 00 00 00 00", "double[1.5]");
+  check("cc 05", "uint8[5]");
+  check("d1 ff 00", "int16[-256]");
+  check("93 01 02 cd 01 00", "uint64[1 2 256]");
+  flags.unpack_narrow = false;
+}
+
+void test_nils() {
+  check("93 01 c0 03", "uint64[1 3]");
+  check("92 c0 c0", "[]");
+  flags.unpack_nil_array_skip = false;
+  check("93 01 c0 03", "uint64[1 0 3]");
+  check("92 c0 c0", "uint8[0 0]");
+  flags.unpack_nil = UNPACK_NIL_NAN;
+  check("93 cb 3f f8 00 00 00 00 00 00 c0 cb 3f f8 00 00 00 00 00 00", "double[1.5 NaN 1.5]");
+  check("93 01 c0 03", "{double[1], double[NaN], double[3]}");
+  check("92 c0 c0", "double[NaN NaN]");
+  flags.unpack_nil = UNPACK_NIL_CELL;
+  check("92 01 c0", "{double[1], {}}");
+  flags.unpack_nil = UNPACK_NIL_EMPTY;
+  check("92 01 c0", "{double[1], []}");
+  flags.unpack_nil = UNPACK_NIL_ZERO;
+  flags.unpack_nil_array_skip = true;
+}
+
+void test_maps() {
+  check("82 a1 61 01 a1 62 92 01 02", "struct(a=double[1], b=uint64[1 2])");
+  check("80", "struct()");
+  check("81 01 02", "{2x1: double[1], double[2]} warning msgpack:non_str_map_keys");
+  flags.unpack_map_as_cells = true;
+  check("81 a1 61 01", "{2x1: 'a', double[1]}");
+  flags.unpack_map_as_cells = false;
+}
+
+void test_strs() {
+  check("92 a1 61 a2 62 63", "{'a', 'bc'}");
+  flags.unpack_str_array_as_string = true;
+  check("92 a1 61 a2 62 63", "string{'a', 'bc'}");
+  // nils keep their place, even with +unpack_nil_array_skip: ["a", nil, "b"]
+  check("93 a1 61 c0 a1 62", "string{'a', '', 'b'}");
+  flags.unpack_nil = UNPACK_NIL_NAN;
+  check("93 a1 61 c0 a1 62", "string{'a', double[NaN], 'b'}");
+  flags.unpack_str_array_as_string = false;
+  check("93 a1 61 c0 a1 62", "{'a', double[NaN], 'b'}");
+  flags.unpack_nil = UNPACK_NIL_CELL;
+  check("93 a1 61 c0 a1 62", "{'a', {}, 'b'}");
+  flags.unpack_nil = UNPACK_NIL_ZERO;
+  check("93 a1 61 c0 a1 62", "{'a', '', 'b'}");
+  flags.unicode_strs = false;
+  check("a2 c3 a9", "uint8[195 169]");
+  flags.unicode_strs = true;
+}
+
+void test_records() {
+  flags.unpack_records = true;
+  check("92 82 a1 74 01 a1 78 cb 40 04 00 00 00 00 00 00 82 a1 74 02 a1 78 cb bf f8 00 00 00 00 00 00",
+        "struct(t=uint64[1 2], x=double[2.5 -1.5])");
+  // nils keep their place in a column: [{t:1, x:2.5}, {t:2, x:nil}, {t:3, x:-1.5}]
+  const char* with_nil = "93 82 a1 74 01 a1 78 cb 40 04 00 00 00 00 00 00 82 a1 74 02 a1 78 c0 "
+                         "82 a1 74 03 a1 78 cb bf f8 00 00 00 00 00 00";
+  check(with_nil, "struct(t=uint64[1 2 3], x=double[2.5 0 -1.5])");
+  flags.unpack_nil = UNPACK_NIL_NAN;
+  check(with_nil, "struct(t=uint64[1 2 3], x=double[2.5 NaN -1.5])");
+  flags.unpack_nil = UNPACK_NIL_CELL;
+  check(with_nil, "struct(t=uint64[1 2 3], x={double[2.5], {}, double[-1.5]})");
+  flags.unpack_nil = UNPACK_NIL_ZERO;
+  check("92 81 a1 73 a1 61 81 a1 73 c0", "struct(s={'a', ''})");
+  check("92 81 a1 73 c0 81 a1 73 c0", "struct(s=uint8[0 0])");
+  // Records whose keys differ stay an array of structs
+  check("92 81 a1 74 01 81 a1 75 02", "{struct(t=double[1]), struct(u=double[2])}");
+  // Nesting deeper than msgpack-c's MSGPACK_EMBED_STACK_SIZE: 40 arrays around a 1
+  string deep, expected = "uint64[1]";
+  for (int i = 0; i < 40; i++) deep += "91 ";
+  for (int i = 1; i < 40; i++) expected = "{" + expected + "}";
+  check((deep + "01").c_str(), expected.c_str());
+  flags.unpack_records = false;
+}
+
+void test_ext() {
+  check("d4 05 07", "{double[5], uint8[7]}");
+  flags.unpack_ext_w_tag = true;
+  check("d4 05 07", "{'MSGPACK_EXT', double[5], uint8[7]}");
+  flags.unpack_ext_w_tag = false;
+  // A chunked array and str (see EXT_CHUNKED)
+  check("93 d7 4a 03 00 00 00 00 00 00 00 92 01 02 91 03", "uint64[1 2 3]");
+  check("93 d7 4a 03 00 00 00 00 00 00 00 a2 61 62 a1 63", "'abc'");
+  check("94 d7 4a 05 00 00 00 00 00 00 00 92 01 02 92 03 04 91 05", "uint64[1 2 3 4 5]");
+  // Anything else that starts with an ext 74 is plain data
+  check("93 d7 4a 03 00 00 00 00 00 00 00 01 02",
+        "{{double[74], uint8[3 0 0 0 0 0 0 0]}, double[1], double[2]}");
+  check("93 d7 4a 04 00 00 00 00 00 00 00 92 01 02 91 03",
+        "{{double[74], uint8[4 0 0 0 0 0 0 0]}, uint64[1 2], uint64[3]}");
+  check("94 d7 4a 05 00 00 00 00 00 00 00 91 01 92 02 03 92 04 05",
+        "{{double[74], uint8[5 0 0 0 0 0 0 0]}, uint64[1], uint64[2 3], uint64[4 5]}");
+  check("93 d7 4a 03 00 00 00 00 00 00 00 a2 61 62 c4 01 63",
+        "{{double[74], uint8[3 0 0 0 0 0 0 0]}, 'ab', uint8[99]}");
+  check("91 d7 4a 00 00 00 00 00 00 00 00", "{{double[74], uint8[0 0 0 0 0 0 0 0]}}");
+  // A bitset keeps its bit count; a payload whose count doesn't match falls back to {code, bytes}
+  ext_codecs[17].kind = EXT_KIND_BITSET;
+  check("c7 0a 11 09 00 00 00 00 00 00 00 05 01", "logical[1 0 1 0 0 0 0 0 1]");
+  check("c7 08 11 00 00 00 00 00 00 00 00", "logical[]");
+  check("c7 0a 11 11 00 00 00 00 00 00 00 05 01", "{double[17], uint8[17 0 0 0 0 0 0 0 5 1]}");
+  check("d5 11 05 01", "{double[17], uint8[5 1]}");
+  ext_codecs[17].kind = EXT_KIND_NONE;
+}
+
+void test_limits() {
+  limits.max_depth = 2;
+  check("91 91 01", "{uint64[1]}");
+  check("91 91 91 01", "prescan 3");
+  limits.max_depth = mp_limits().max_depth;
+  limits.max_str_len = 2;
+  check("a3 61 62 63", "prescan 3");
+  limits.max_str_len = mp_limits().max_str_len;
+  check("92 01", "prescan 1");
+  // A header claiming 2^32-1 elements is incomplete, or over a length limit if one is set
+  check("dd ff ff ff ff 01 02 03", "prescan 1");
+  limits.max_container_len = 1000000;
+  check("dd ff ff ff ff 01 02 03", "prescan 3");
+  limits.max_container_len = mp_limits().max_container_len;
+  check("c1", "prescan 2");
+}
+
+static std::mt19937_64 rng;
+
+size_t random_below(size_t n) { return rng() % n; }
+
+void put_be(string& s, uint64_t v, int width) {
+  for (int k = width - 1; k >= 0; k--) s += (char)(v >> (8 * k));
+}
+
+// Append a random object. Arrays tend to hold elements of one type (leaf_type) so that typed rows,
+// speculative rows and their fallbacks all come up; a leaf_type of -1 picks each leaf at random.
+void random_object(string& s, int depth, int leaf_type) {
+  int kind = depth > 6 ? 50 + random_below(50) : random_below(100);
+  if (kind < 12) {
+    size_t n = random_below(4) ? random_below(5) : random_below(40);
+    if (n < 16 && random_below(2)) {
+      s += (char)(0x90 | n);
+    } else {
+      int wide = random_below(2);
+      s += (char)(wide ? 0xdd : 0xdc);
+      put_be(s, n, wide ? 4 : 2);
+    }
+    int elem_type = random_below(12);
+    for (size_t i = 0; i < n; i++) random_object(s, depth + 1, random_below(5) ? elem_type : -1);
+    return;
+  }
+  if (kind < 20) {
+    size_t n = random_below(5);
+    if (random_below(2)) {
+      s += (char)(0x80 | n);
+    } else {
+      s += (char)0xde;
+      put_be(s, n, 2);
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (random_below(6)) {
+        // Mostly str keys, sometimes repeated
+        string key = "k" + std::to_string(random_below(3) ? i : random_below(100));
+        s += (char)(0xa0 | key.size());
+        s += key;
+      } else {
+        random_object(s, depth + 1, -1);
+      }
+      random_object(s, depth + 1, -1);
+    }
+    return;
+  }
+  switch (leaf_type >= 0 ? leaf_type : random_below(12)) {
+    case 1:
+      s += (char)(random_below(2) ? 0xc3 : 0xc2);
+      break;
+    case 2: {  // positive fixint or uint 8-64
+      int width = random_below(5);
+      if (width == 4) {
+        s += (char)random_below(128);
+      } else {
+        s += (char)(0xcc + width);
+        put_be(s, rng(), 1 << width);
+      }
+      break;
+    }
+    case 3: {  // negative fixint or int 8-64
+      int width = random_below(5);
+      if (width == 4) {
+        s += (char)(0xe0 + random_below(32));
+      } else {
+        s += (char)(0xd0 + width);
+        put_be(s, rng() >> random_below(64), 1 << width);
+      }
+      break;
+    }
+    case 4: {
+      float f = (float)((int)random_below(1000) - 500) / 7;
+      uint32_t bits;
+      memcpy(&bits, &f, 4);
+      s += (char)0xca;
+      put_be(s, bits, 4);
+      break;
+    }
+    case 5: {
+      double d = (double)random_below(100000) / 3;
+      uint64_t bits;
+      memcpy(&bits, &d, 8);
+      s += (char)0xcb;
+      put_be(s, bits, 8);
+      break;
+    }
+    case 6: case 7: {  // str, mostly ASCII, sometimes invalid UTF-8
+      size_t n = random_below(40);
+      if (n < 32 && random_below(2)) {
+        s += (char)(0xa0 | n);
+      } else {
+        int width = random_below(3);
+        s += (char)(0xd9 + width);
+        put_be(s, n, 1 << width);
+      }
+      for (size_t i = 0; i < n; i++) s += (char)(random_below(4) ? 'a' + random_below(26) : rng());
+      break;
+    }
+    case 8: {  // bin
+      size_t n = random_below(10);
+      int width = random_below(3);
+      s += (char)(0xc4 + width);
+      put_be(s, n, 1 << width);
+      for (size_t i = 0; i < n; i++) s += (char)rng();
+      break;
+    }
+    case 9: {  // fixext
+      int width = random_below(5);
+      s += (char)(0xd4 + width);
+      s += (char)random_below(256);
+      for (int i = 0; i < (1 << width); i++) s += (char)rng();
+      break;
+    }
+    case 10: {  // ext 8-32
+      size_t n = random_below(20);
+      int width = random_below(3);
+      s += (char)(0xc7 + width);
+      put_be(s, n, 1 << width);
+      s += (char)random_below(256);
+      for (size_t i = 0; i < n; i++) s += (char)rng();
+      break;
+    }
+    default:
+      s += (char)0xc0;
+  }
+}
+
+// Whether read_tree gave the same tree as msgpack-c.
+bool same_object(const msgpack_object& a, const msgpack_object& b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case MSGPACK_OBJECT_NIL: return true;
+    case MSGPACK_OBJECT_BOOLEAN: return a.via.boolean == b.via.boolean;
+    case MSGPACK_OBJECT_POSITIVE_INTEGER: return a.via.u64 == b.via.u64;
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER: return a.via.i64 == b.via.i64;
+    case MSGPACK_OBJECT_FLOAT32: case MSGPACK_OBJECT_FLOAT64:
+      return !memcmp(&a.via.f64, &b.via.f64, sizeof(double));
+    case MSGPACK_OBJECT_STR:
+      return a.via.str.size == b.via.str.size && a.via.str.ptr == b.via.str.ptr;
+    case MSGPACK_OBJECT_BIN:
+      return a.via.bin.size == b.via.bin.size && a.via.bin.ptr == b.via.bin.ptr;
+    case MSGPACK_OBJECT_EXT:
+      return a.via.ext.type == b.via.ext.type && a.via.ext.size == b.via.ext.size &&
+             a.via.ext.ptr == b.via.ext.ptr;
+    case MSGPACK_OBJECT_ARRAY:
+      if (a.via.array.size != b.via.array.size) return false;
+      for (size_t i = 0; i < a.via.array.size; i++)
+        if (!same_object(a.via.array.ptr[i], b.via.array.ptr[i])) return false;
+      return true;
+    case MSGPACK_OBJECT_MAP:
+      if (a.via.map.size != b.via.map.size) return false;
+      for (size_t i = 0; i < a.via.map.size; i++)
+        if (!same_object(a.via.map.ptr[i].key, b.via.map.ptr[i].key) ||
+            !same_object(a.via.map.ptr[i].val, b.via.map.ptr[i].val))
+          return false;
+      return true;
+  }
+  return false;
+}
+
+bool same_value(const NativeValue* a, const NativeValue* b) {
+  if (a->kind != b->kind || a->rows != b->rows || a->cols != b->cols ||
+      a->is_string != b->is_string || a->cls != b->cls || a->data != b->data ||
+      a->chars != b->chars || a->field_names != b->field_names ||
+      a->elems.size() != b->elems.size())
+    return false;
+  for (size_t i = 0; i < a->elems.size(); i++)
+    if (!same_value(a->elems[i], b->elems[i])) return false;
+  return true;
+}
+
+// Unpack rounds of random messages with random flags through read_tree and ObjectUnpacker and
+// through StreamUnpacker, and check that both paths agree, and that read_tree agrees with msgpack-c.
+void cross_check(int rounds) {
+  NativeBuilder object_builder, stream_builder;
+  ObjectUnpacker<NativeBuilder> object_unpacker(object_builder, flags, limits);
+  StreamUnpacker<NativeBuilder> stream_unpacker(stream_builder, flags, limits);
+  msgpack_unpacked msg;
+  msgpack_unpacked_init(&msg);
+  msgpack_zone* zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  for (int round = 0; round < rounds; round++) {
+    flags.unicode_strs = random_below(4);
+    flags.unpack_map_as_cells = !random_below(4);
+    flags.unpack_narrow = random_below(2);
+    flags.unpack_ext_w_tag = random_below(2);
+    flags.unpack_nil_array_skip = random_below(2);
+    flags.unpack_str_array_as_string = random_below(2);
+    flags.unpack_nil = (NilUnpack)random_below(4);
+    limits.max_depth = random_below(3) ? mp_limits().max_depth : random_below(5);
+    string s;
+    int nmsgs = 1 + random_below(3);
+    for (int m = 0; m < nmsgs; m++) random_object(s, 0, -1);
+    size_t msgpack_c_offset = 0, object_offset = 0, stream_offset = 0;
+    for (int m = 0; m < nmsgs; m++) {
+      if (msgpack_unpack_next(&msg, s.data(), s.size(), &msgpack_c_offset) <= 0) {
+        printf("FAIL round %d: msgpack-c can't parse message %d\n", round, m);
+        failures++;
+        break;
+      }
+      msgpack_zone_clear(zone);
+      msgpack_object tree = stream_unpacker.read_tree(s.data(), s.size(), &object_offset, zone);
+      if (object_offset != msgpack_c_offset || !same_object(tree, msg.data)) {
+        printf("FAIL round %d: read_tree and msgpack-c differ on message %d\n", round, m);
+        failures++;
+        break;
+      }
+      NativeValue *object_value = NULL, *stream_value = NULL;
+      string object_error, stream_error;
+      object_builder.warnings.clear();
+      stream_builder.warnings.clear();
+      try {
+        object_value = object_unpacker.unpack(tree);
+      } catch (const std::exception& e) {
+        object_error = e.what();
+        object_unpacker.reset();
+      }
+      try {
+        stream_value = stream_unpacker.unpack(s.data(), s.size(), &stream_offset);
+      } catch (const std::exception& e) {
+        stream_error = e.what();
+        stream_unpacker.reset();
+      }
+      if (object_error != stream_error) {
+        printf("FAIL round %d: errors differ: '%s' vs '%s'\n", round, object_error.c_str(),
+               stream_error.c_str());
+        failures++;
+        break;
+      }
+      if (!object_error.empty()) break;
+      if (object_offset != stream_offset ||
+          object_builder.warnings != stream_builder.warnings ||
+          !same_value(object_value, stream_value)) {
+        printf("FAIL round %d message %d: object %s, stream %s\n", round, m,
+               describe(object_value).c_str(), describe(stream_value).c_str());
+        failures++;
+        break;
+      }
+    }
+    // A truncated message must raise an error, not read past the end
+    if (round % 10 == 0) {
+      for (size_t cut = 0; cut < s.size() && cut < 200; cut++) {
+        size_t offset = 0;
+        try {
+          stream_unpacker.unpack(s.data(), cut, &offset);
+        } catch (const std::exception&) {
+          stream_unpacker.reset();
+          continue;
+        }
+        if (offset > cut) {
+          printf("FAIL round %d: read past a cut at %zu\n", round, cut);
+          failures++;
+        }
+      }
+    }
+    object_builder.clear();
+    stream_builder.clear();
+  }
+  msgpack_unpacked_destroy(&msg);
+  msgpack_zone_free(zone);
+  flags = mp_flags();
+  limits = mp_limits();
+}
+
+int main(int argc, char** argv) {
+  int rounds = 20000;
+  unsigned long seed = 12345;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (arg == "-s" && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [-n rounds] [-s seed]\n", argv[0]);
+      return 2;
+    }
+  }
+  rng.seed(seed);
+  test_rows();
+  test_scalars();
+  test_nils();
+  test_maps();
+  test_strs();
+  test_records();
+  test_ext();
+  test_limits();
+  cross_check(rounds);
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("All tests passed.\n");
+  return 0;
+}
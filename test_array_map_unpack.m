@@ -74,6 +74,21 @@ for i = 1:numel(unpacked)
     assert(isnan(unpacked(i)), "Should be NaN");
 end
 
+%% array of arrays is a cell, not an all-nil array
+% [[1, 2], [3]] and [nil, [1, "a"]]
+unpacked = msgpack('unpack', uint8([146, 146, 1, 2, 145, 3]));
+assert(iscell(unpacked) && isequal(size(unpacked), [1 2]), 'Should be 1x2 cell');
+assert(isequal(unpacked, {uint64([1 2]), uint64(3)}), 'Wrong cell of rows');
+unpacked = msgpack('unpack', uint8([146, nil, 146, 1, 161, uint8('a')]));
+assert(isequal(unpacked, {0, {1, 'a'}}), 'Wrong cell of cells');
+
+%% float32 scalar with +unpack_narrow
+msgpack('set_flags +unpack_narrow');
+unpacked = msgpack('unpack', uint8([202, 63, 192, 0, 0]));
+assert(isa(unpacked, 'single') && isequal(size(unpacked), [1 1]) && unpacked == 1.5, ...
+       'Should be 1x1 single');
+msgpack('reset_flags');
+
 %% map with nil
 % map with 2 elements, x: nil, y: {}
 packed = uint8([fixmap+2, 161, uint8('x'), nil, 161, uint8('y'), hex2dec('90')]);
@@ -113,5 +128,119 @@ for i=1:numel(expected)
     end
 end
 
+%% array of same-keyed maps as records
+msgpack('reset_flags');
+msgpack('set_flags +unpack_records');
+% [{t: 1, x: 2.5}, {t: 2, x: nil}, {t: 3, x: -1.5}]
+packed = uint8([147, ...
+                fixmap+2, 161, uint8('t'), 1, 161, uint8('x'), 203, 64, 4, 0, 0, 0, 0, 0, 0, ...
+                fixmap+2, 161, uint8('t'), 2, 161, uint8('x'), nil, ...
+                fixmap+2, 161, uint8('t'), 3, 161, uint8('x'), 203, 191, 248, 0, 0, 0, 0, 0, 0]);
+unpacked = msgpack('unpack', packed);
+assert(isstruct(unpacked) && isscalar(unpacked), 'Should be scalar struct');
+assert(isequal(unpacked.t, uint64([1 2 3])), 'Wrong t column');
+assert(isequal(unpacked.x, [2.5 0 -1.5]), 'Wrong x column');
+msgpack('set_flags +unpack_nil_NaN');
+unpacked = msgpack('unpack', packed);
+assert(isequaln(unpacked.x, [2.5 NaN -1.5]), 'Wrong x column with NaN nils');
+msgpack('set_flags +unpack_nil_cell');
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked.x) && numel(unpacked.x) == 3 && isequal(unpacked.x{2}, {}), ...
+       'Wrong x column with cell nils');
+msgpack('reset_flags');
+
+%% array of strs as cellstr or string array
+% ["ab", nil, "", "\u00e9"]
+packed = uint8([148, 162, uint8('ab'), nil, 160, 162, 195, 169]);
+msgpack('set_flags -unpack_nil_array_skip');
+unpacked = msgpack('unpack', packed);
+assert(iscellstr(unpacked) && isequal(size(unpacked), [1 4]), 'Should be 1x4 cellstr');
+assert(isequal(unpacked, {'ab', '', '', char(233)}), 'Wrong cellstr');
+% nils keep their place in strs even with +unpack_nil_array_skip
+msgpack('set_flags +unpack_nil_array_skip +unpack_str_array_as_string');
+unpacked = msgpack('unpack', packed);
+assert(isstring(unpacked) && isequal(unpacked, ["ab", "", "", string(char(233))]), ...
+       'Wrong string array');
+msgpack('set_flags +unpack_nil_NaN');
+unpacked = msgpack('unpack', packed);
+assert(isstring(unpacked) && isequal(ismissing(unpacked), [false true false false]), ...
+       'nil should be <missing>');
+msgpack('set_flags -unpack_str_array_as_string');
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked) && numel(unpacked) == 4 && isnan(unpacked{2}), 'nil should be NaN');
+msgpack('set_flags +unpack_nil_cell');
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked) && numel(unpacked) == 4 && isequal(unpacked{2}, {}), 'nil should be {}');
+msgpack('reset_flags');
+
+%% deep nesting and max_depth
+deep = 1;
+for i = 1:25
+    deep = {deep, i};
+end
+unpacked = msgpack('unpack', msgpack('pack', deep));
+for i = 25:-1:1
+    assert(iscell(unpacked) && unpacked{2} == i, 'Wrong deep unpack at level %d', i);
+    unpacked = unpacked{1};
+end
+packed_deep = msgpack('pack', deep);
+% The object tree of +unpack_records and unpack_schema has no nesting limit of its own
+deeper = deep;
+for i = 26:40
+    deeper = {deeper, i};
+end
+msgpack('set_flags +unpack_records');
+unpacked = msgpack('unpack', msgpack('pack', deeper));
+msgpack('reset_flags');
+for i = 40:-1:1
+    assert(iscell(unpacked) && unpacked{2} == i, 'Wrong deep records unpack at level %d', i);
+    unpacked = unpacked{1};
+end
+id = msgpack('register_schema', struct('any', {{}}));
+unpacked = msgpack('unpack_schema', msgpack('pack', struct('any', {deeper})), id);
+assert(iscell(unpacked.any) && unpacked.any{2} == 40, 'Wrong deep schema unpack');
+msgpack('clear_schemas');
+msgpack('set_flags max_depth=10');
+try
+    msgpack('pack', deep);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:max_depth'), 'Wrong error for pack');
+end
+try
+    msgpack('unpack', packed_deep);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:max_depth'), 'Wrong error for unpack');
+end
+msgpack('set_flags +unpack_records');
+try
+    msgpack('unpack', packed_deep);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:max_depth'), 'Wrong error for records unpack');
+end
+msgpack('reset_flags');
+
+%% long arrays filled in one pass, and the fallbacks when a later element differs
+% [7 x 20]
+packed = uint8([220, 0, 20, repmat([204, 7], 1, 20)]);
+unpacked = msgpack('unpack', packed);
+assert(isa(unpacked, 'uint64') && isequal(unpacked, repmat(uint64(7), 1, 20)), 'Wrong typed row');
+% [7 x 19, nil]
+packed = uint8([220, 0, 20, repmat([204, 7], 1, 19), 192]);
+unpacked = msgpack('unpack', packed);
+assert(isa(unpacked, 'uint64') && isequal(unpacked, repmat(uint64(7), 1, 19)), 'nil not skipped');
+% [7 x 19, "x"]
+packed = uint8([220, 0, 20, repmat([204, 7], 1, 19), 161, uint8('x')]);
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked) && numel(unpacked) == 20, 'Should be 1x20 cell');
+assert(isequal(unpacked{19}, 7) && isequal(unpacked{20}, 'x'), 'Wrong cells after a str');
+% [7 x 19, [1]]
+packed = uint8([220, 0, 20, repmat([204, 7], 1, 19), 145, 1]);
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked) && numel(unpacked) == 20, 'Should be 1x20 cell');
+assert(isequal(unpacked{19}, 7) && isequal(unpacked{20}, 1), 'Wrong cells after an array');
+
 %% all passed
 disp('All tests passed.');
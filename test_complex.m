@@ -0,0 +1,34 @@
+msgpack('reset_flags');
+
+%% complex double round trip
+expected = [1+2i, -3.5-4i, 0+1e-300i];
+unpacked = msgpack('unpack', msgpack('pack', expected));
+assert(strcmp(class(expected), class(unpacked)), 'Different class');
+assert(~isreal(unpacked), 'Should be complex');
+assert(isequal(expected, unpacked), 'Mismatch');
+
+%% complex integer and single round trip
+for cls = {'single', 'int8', 'uint16', 'int32', 'uint64'}
+    expected = complex(cast([1 2 3], cls{1}), cast([4 5 6], cls{1}));
+    unpacked = msgpack('unpack', msgpack('pack', expected));
+    assert(strcmp(cls{1}, class(unpacked)), 'Wrong class for %s', cls{1});
+    assert(isequal(expected, unpacked), 'Mismatch for %s', cls{1});
+end
+
+%% complex scalar
+unpacked = msgpack('unpack', msgpack('pack', 2i));
+assert(isscalar(unpacked) && unpacked == 2i, 'Scalar mismatch');
+
+%% wire format: ext 67, class byte, interleaved values
+packed = msgpack('pack', complex(int8([1 2]), int8([-1 -2])));
+expected = uint8([hex2dec('c7'), 5, 67, 8, 1, 255, 2, 254]);
+assert(isequal(packed, expected), 'Wrong wire format');
+
+%% complex inside struct
+s.iq = complex(rand(1, 5), rand(1, 5));
+s.n = 5;
+unpacked = msgpack('unpack', msgpack('pack', s));
+assert(isequal(s.iq, unpacked.iq), 'Struct field mismatch');
+
+%% all passed
+disp('All tests passed.');
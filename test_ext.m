@@ -0,0 +1,114 @@
+msgpack('reset_flags');
+
+%% unregistered codes unpack to {code, bytes}
+packed = msgpack('pack', {'MSGPACK_EXT', 16, uint8([1 0 254 255])});
+unpacked = msgpack('unpack', packed);
+assert(iscell(unpacked) && isequal(unpacked, {16, uint8([1 0 254 255])}), 'Wrong generic ext');
+
+%% typed vector round trip
+msgpack('register_ext', 16, 'int16');
+unpacked = msgpack('unpack', packed);
+assert(isa(unpacked, 'int16') && isequal(unpacked, int16([1 -2])), 'Wrong int16 decode');
+expected = int16([1 -2 3 32767]);
+packed = msgpack('pack', {'MSGPACK_EXT', 16, expected});
+assert(isequal(packed(1:3), uint8([hex2dec('d7'), 16, 1])), 'Wrong wire format');
+assert(isequal(msgpack('unpack', packed), expected), 'Wrong int16 round trip');
+msgpack('register_ext', 20, 'double');
+expected = [pi -Inf NaN];
+unpacked = msgpack('unpack', msgpack('pack', {'MSGPACK_EXT', 20, expected}));
+assert(isequaln(unpacked, expected), 'Wrong double round trip');
+try
+    msgpack('pack', {'MSGPACK_EXT', 16, [1 2]});
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:ext_encode'), 'Wrong error for class mismatch');
+end
+
+%% odd-sized payload falls back to {code, bytes}
+unpacked = msgpack('unpack', msgpack('pack', {'MSGPACK_EXT', 16, uint8([1 2 3])}));
+assert(iscell(unpacked) && isequal(unpacked{2}, uint8([1 2 3])), 'Should fall back');
+
+%% bitset
+msgpack('register_ext', 17, 'bitset');
+bits = logical([1 0 1 0 0 0 0 0 1]);
+packed = msgpack('pack', {'MSGPACK_EXT', 17, bits});
+assert(isequal(packed, uint8([hex2dec('c7'), 10, 17, 9, 0, 0, 0, 0, 0, 0, 0, 5, 1])), ...
+       'Wrong bitset wire format');
+unpacked = msgpack('unpack', packed);
+assert(islogical(unpacked) && isequal(unpacked, bits), 'Should keep all 9 bits');
+unpacked = msgpack('unpack', msgpack('pack', {'MSGPACK_EXT', 17, false(1, 0)}));
+assert(islogical(unpacked) && isempty(unpacked), 'Should be an empty logical');
+% A bit count that doesn't match the payload falls back to {code, bytes}
+unpacked = msgpack('unpack', uint8([hex2dec('d5'), 17, 5, 1]));
+assert(iscell(unpacked) && isequal(unpacked{2}, uint8([5 1])), 'Should fall back');
+
+%% fixed point
+msgpack('register_ext', 18, 'fixed', 'int32', 1e-3);
+packed = msgpack('pack', {'MSGPACK_EXT', 18, [1.2344 -0.5 double(intmax('int32')) * 1e-3]});
+unpacked = msgpack('unpack', packed);
+assert(isa(unpacked, 'double'), 'Should be double');
+assert(isequal(unpacked, [1.234 -0.5 double(intmax('int32')) * 1e-3]), 'Wrong fixed values');
+% Values that don't fit the class are errors, not saturated
+for bad = {1e12, -1e12, NaN, Inf}
+    try
+        msgpack('pack', {'MSGPACK_EXT', 18, [1 bad{1}]});
+        error('Should have failed for %g', bad{1});
+    catch err
+        assert(strcmp(err.identifier, 'msgpack:ext_encode'), 'Wrong error for %g', bad{1});
+    end
+end
+
+%% list and unregister
+exts = msgpack('list_ext');
+codes = [exts.code];
+assert(isequal(codes, sort(codes)), 'Not in code order');
+assert(all(ismember([16 17 18 20 67 68 83 99], codes)), 'Missing codes');
+e = exts(codes == 18);
+assert(strcmp(e.kind, 'fixed') && strcmp(e.class, 'int32') && e.scale == 1e-3, 'Wrong entry');
+e = exts(codes == 67);
+assert(strcmp(e.kind, 'complex') && isempty(e.class) && isempty(e.scale), 'Wrong default entry');
+msgpack('unregister_ext', 67);
+unpacked = msgpack('unpack', msgpack('pack', 1+2i));
+assert(iscell(unpacked) && unpacked{1} == 67, 'complex should unpack as {code, bytes}');
+for code = [16 17 18 20]
+    msgpack('unregister_ext', code);
+end
+msgpack('register_ext', 67, 'fixed', 'int8', 1);
+msgpack('unregister_ext', 67);
+clear msgpack
+assert(isequal(msgpack('unpack', msgpack('pack', 1+2i)), 1+2i), 'Defaults not restored');
+
+%% cells that only look like exts are packed as plain cells
+plain = {'MSGPACK_EXT', 1.5, 'abc'};
+assert(isequal(msgpack('unpack', msgpack('pack', plain)), plain), 'Wrong plain cell for code 1.5');
+plain = {'MSGPACK_EXT', 300, 'abc'};
+assert(isequal(msgpack('unpack', msgpack('pack', plain)), plain), 'Wrong plain cell for code 300');
+
+%% bad arguments
+try
+    msgpack('register_ext', 200, 'int16');
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:invalid_ext_code'), 'Wrong error for bad code');
+end
+try
+    msgpack('register_ext', 5, 'fixed', 'double', 2);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:bad_argument'), 'Wrong error for bad class');
+end
+try
+    msgpack('register_ext', 5, 'quaternion');
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:bad_argument'), 'Wrong error for bad kind');
+end
+try
+    msgpack('pack', {'MSGPACK_EXT', 1.5, uint8(1:3)});
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:invalid_ext_code'), 'Wrong error for bad raw code');
+end
+
+%% all passed
+disp('All tests passed.');
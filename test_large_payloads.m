@@ -0,0 +1,103 @@
+msgpack('reset_flags');
+
+%% chunked wire format
+% [1 2 3] in pieces of 2: [marker(3), [1.0, 2.0], [3.0]]
+msgpack('set_flags max_chunk_len=2');
+packed = msgpack('pack', [1 2 3]);
+assert(isequal(packed(1:11), uint8([147, 215, 74, 3, 0, 0, 0, 0, 0, 0, 0])), 'Wrong marker');
+assert(packed(12) == 146 && packed(31) == 145, 'Wrong piece headers');
+assert(isequal(msgpack('unpack', packed), [1 2 3]), 'Wrong chunked array');
+unchunked = msgpack('pack', [1 2]);
+assert(unchunked(1) == 146, 'Arrays up to max_chunk_len should not be chunked');
+
+%% chunked round trips
+msgpack('set_flags max_chunk_len=3');
+values = {pi * (1:10), int16(-11:-1), logical(mod(1:11, 2)), uint8(1:20), ...
+          ['caf', char(233), ' ', char(8364), char(8364), ' chunked'], ...
+          {1, 'two', [3 4 5 6], int8(7)}, complex(1:5, 6:10), ...
+          struct('x', 1:7, 'name', 'abcdefg')};
+for i = 1:numel(values)
+    unpacked = msgpack('unpack', msgpack('pack', values{i}));
+    assert(isequal(unpacked, values{i}), 'Wrong chunked round trip for value %d', i);
+end
+msgpack('set_flags +pack_u8_bin');
+bytes = uint8(0:255);
+assert(isequal(msgpack('unpack', msgpack('pack', bytes)), bytes), 'Wrong chunked bin');
+msgpack('set_flags -pack_u8_bin');
+unpacked = msgpack('unpack', msgpack('pack', {'MSGPACK_EXT', 16, uint8(1:10)}));
+assert(isequal(unpacked, {16, uint8(1:10)}), 'Wrong chunked ext');
+strs = ["alpha", "beta", "gamma"];
+assert(isequal(msgpack('unpack', msgpack('pack', strs)), strs), 'Wrong chunked string array');
+packed = msgpack('pack', 1:10, 'abcdefgh');
+objs = msgpack('unpacker', packed);
+assert(isequal(objs, {1:10, 'abcdefgh'}), 'Wrong chunked messages from unpacker');
+id = msgpack('register_schema', struct('x', zeros(1, 0), 'name', ''));
+unpacked = msgpack('unpack_schema', msgpack('pack', struct('x', 1:10, 'name', 'abcdefgh')), id);
+assert(isequal(unpacked.x, 1:10) && strcmp(unpacked.name, 'abcdefgh'), 'Wrong chunked schema');
+msgpack('clear_schemas');
+msgpack('reset_flags');
+
+%% arrays that only look chunked are plain data
+% marker says 5, pieces hold 2
+plain = msgpack('unpack', uint8([146, 215, 74, 5, 0, 0, 0, 0, 0, 0, 0, 146, 1, 2]));
+assert(iscell(plain) && numel(plain) == 2 && isequal(plain{2}, [1 2]), ...
+       'Wrong plain data for bad total');
+% pieces of different types
+plain = msgpack('unpack', uint8([147, 215, 74, 2, 0, 0, 0, 0, 0, 0, 0, 161, uint8('a'), ...
+                                 196, 1, uint8('b')]));
+assert(iscell(plain) && numel(plain) == 3 && strcmp(plain{2}, 'a'), ...
+       'Wrong plain data for mixed pieces');
+% a marker alone
+plain = msgpack('unpack', uint8([145, 215, 74, 0, 0, 0, 0, 0, 0, 0, 0]));
+assert(iscell(plain) && numel(plain) == 1, 'Wrong plain data for a marker alone');
+try
+    msgpack('pack', {'MSGPACK_EXT', 74, uint8(1:8)});
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:invalid_ext_code'), 'Wrong error for packing code 74');
+end
+try
+    msgpack('register_ext', 74, 'int16');
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:invalid_ext_code'), 'Wrong error for code 74');
+end
+
+%% multi-GB round trips (skipped without enough free memory)
+avail = 0;
+if ispc
+    [~, sys] = memory;
+    avail = sys.PhysicalMemory.Available;
+elseif exist('/proc/meminfo', 'file')
+    tok = regexp(fileread('/proc/meminfo'), 'MemAvailable:\s+(\d+) kB', 'tokens', 'once');
+    if ~isempty(tok)
+        avail = str2double(tok{1}) * 1024;
+    end
+end
+n = 2^32 + 16;  % Over MessagePack's 32-bit length limit
+if avail < 8 * n
+    fprintf('Skipping multi-GB round trips: %.1f GB available, %.1f GB needed.\n', ...
+            avail / 2^30, 8 * n / 2^30);
+else
+    % Over 2^31 elements in one array
+    bits = true(1, 2^31 + 8);
+    bits(end) = false;
+    unpacked = msgpack('unpack', msgpack('pack', bits));
+    assert(islogical(unpacked) && numel(unpacked) == numel(bits), 'Wrong size for 2^31 bools');
+    assert(all(unpacked(1:end-1)) && ~unpacked(end), 'Wrong values for 2^31 bools');
+    clear bits unpacked
+    % Over 2^32 bytes in one bin, packed as two pieces
+    big = zeros(1, n, 'uint8');
+    big([1, 2^32, n]) = [1, 2, 3];
+    msgpack('set_flags +pack_u8_bin');
+    packed = msgpack('pack', big);
+    assert(isequal(packed(1:3), uint8([147, 215, 74])), 'Should be chunked');
+    unpacked = msgpack('unpack', packed);
+    clear packed
+    assert(isa(unpacked, 'uint8') && isequal(unpacked, big), 'Wrong 4 GB bin round trip');
+    clear big unpacked
+    msgpack('reset_flags');
+end
+
+%% all passed
+disp('All tests passed.');
@@ -0,0 +1,72 @@
+msgpack('reset_flags');
+nil = uint8(hex2dec('c0'));
+
+%% prescan stats
+packed = msgpack('pack', struct('a', {{1, 'hello', [1 2 3]}}, 'b', 2));
+stats = msgpack('prescan', [packed, nil]);
+assert(strcmp(stats.status, 'ok') && isempty(stats.limit), 'Should scan ok');
+assert(stats.bytes == numel(packed), 'Wrong message size');
+assert(stats.depth == 3, 'Wrong depth');
+assert(stats.max_str_len == 5 && stats.max_container_len == 3, 'Wrong maximum lengths');
+assert(stats.projected_bytes > 0, 'Should project some memory');
+stats = msgpack('prescan', [packed, nil], numel(packed));
+assert(strcmp(stats.status, 'ok') && stats.bytes == 1 && stats.objects == 1, 'Wrong offset scan');
+stats = msgpack('prescan', packed(1:end-1));
+assert(strcmp(stats.status, 'incomplete'), 'Truncated message should be incomplete');
+
+%% hostile container header is rejected without allocating
+hostile = uint8([221, 255, 255, 255, 255, 1, 2, 3]);  % array32 claiming 2^32-1 elements
+stats = msgpack('prescan', hostile);
+assert(strcmp(stats.status, 'incomplete'), 'Oversized count should be incomplete');
+try
+    msgpack('unpack', hostile);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:unpack_error'), 'Wrong error for a truncated message');
+end
+objs = msgpack('unpacker', hostile);
+assert(isempty(objs), 'Unpacker should wait for more data');
+% With a length limit the header itself is over it
+msgpack('set_flags max_container_len=1000000');
+stats = msgpack('prescan', hostile);
+assert(strcmp(stats.status, 'limit') && strcmp(stats.limit, 'max_container_len'), ...
+       'Oversized count should be over the limit');
+try
+    msgpack('unpack', hostile);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:limit_exceeded'), 'Wrong error for a hostile header');
+    assert(contains(err.message, 'max_container_len'), 'Error should name the limit');
+end
+msgpack('reset_flags');
+
+%% limits raise before unpacking
+msgpack('set_flags max_str_len=4');
+try
+    msgpack('unpack', packed);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:limit_exceeded'), 'Wrong error for max_str_len');
+end
+stats = msgpack('prescan', packed);
+assert(strcmp(stats.status, 'limit') && strcmp(stats.limit, 'max_str_len'), 'Wrong prescan limit');
+msgpack('set_flags max_str_len=Inf max_container_len=2');
+try
+    msgpack('unpacker', packed);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:limit_exceeded'), 'Wrong error for max_container_len');
+end
+msgpack('set_flags max_container_len=Inf max_bytes=100');
+try
+    msgpack('unpack', packed);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:limit_exceeded'), 'Wrong error for max_bytes');
+end
+msgpack('reset_flags');
+unpacked = msgpack('unpack', packed);
+assert(unpacked.b == 2, 'Should unpack after reset');
+
+%% all passed
+disp('All tests passed.');
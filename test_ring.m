@@ -0,0 +1,99 @@
+msgpack('reset_flags');
+name = sprintf('msgpack_test_ring_%d', feature('getpid'));
+msgpack('ring_unlink', name);
+
+%% producer and consumer handles on the same ring
+producer = msgpack('ring_open', name, 256);
+consumer = msgpack('ring_open', name);
+objs = msgpack('ring_unpack', consumer);
+assert(isempty(objs), 'New ring should be empty');
+
+%% messages wrap around the end of a small ring
+count = 0;
+for i = 1:200
+    n = msgpack('ring_pack', producer, i, sprintf('msg %d', i));
+    assert(n == 2, 'Messages should fit');
+    objs = msgpack('ring_unpack', consumer);
+    assert(numel(objs) == 2, 'Wrong number of messages');
+    assert(objs{1} == i && strcmp(objs{2}, sprintf('msg %d', i)), 'Wrong message');
+    count = count + 1;
+end
+assert(count == 200, 'Loop did not finish');
+
+%% a full ring packs as many as fit and unpacks in batches
+n = msgpack('ring_pack', producer, 1:10, 11:20, 21:30, 31:40, 41:50, 51:60, 61:70);
+assert(n > 0 && n < 7, 'Ring should fill up');
+objs = msgpack('ring_unpack', consumer, 1);
+assert(numel(objs) == 1 && isequal(objs{1}, 1:10), 'Wrong first message');
+objs = msgpack('ring_unpack', consumer);
+assert(numel(objs) == n - 1, 'Wrong number of remaining messages');
+assert(isequal(objs{end}, (n-1)*10+1:n*10), 'Wrong last message');
+
+%% oversized messages are rejected
+try
+    msgpack('ring_pack', producer, 1:1000);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:ring_message_too_large'), 'Wrong error');
+end
+
+%% a record that fails to unpack is dropped, not left to stall the ring
+msgpack('set_flags max_chunk_len=4');
+n = msgpack('ring_pack', producer, 1:10, 'next');
+msgpack('set_flags max_chunk_len=4294967295 max_container_len=5');
+assert(n == 2, 'Messages should fit');
+try
+    msgpack('ring_unpack', consumer);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:limit_exceeded'), 'Wrong error for a chunked record');
+end
+msgpack('reset_flags');
+objs = msgpack('ring_unpack', consumer);
+assert(numel(objs) == 1 && strcmp(objs{1}, 'next'), 'Failed record not dropped');
+
+%% records from a C producer built on msgpack_ring.h, including malformed ones
+src = fullfile(fileparts(mfilename('fullpath')), 'msgpack_ring_producer.c');
+exe = [tempname, '_producer'];
+if system(sprintf('cc -o %s %s -lrt', exe, src)) ~= 0
+    disp('No C compiler, skipping the C producer tests.');
+else
+    % More messages than the ring holds, so the producer waits for the consumer
+    system(sprintf('%s %s 100 &', exe, name));
+    objs = {};
+    deadline = tic;
+    while numel(objs) < 100 && toc(deadline) < 10
+        objs = [objs, msgpack('ring_unpack', consumer)]; %#ok<AGROW>
+    end
+    assert(numel(objs) == 100, 'Missing messages from the C producer');
+    for i = 1:100
+        assert(objs{i}{1} == i && strcmp(objs{i}{2}, sprintf('msg %d', i)), 'Wrong message %d', i);
+    end
+    for mode = {'--malformed', '--bad-length'}
+        assert(system(sprintf('%s %s %s 0', exe, mode{1}, name)) == 0, 'Producer failed');
+        try
+            msgpack('ring_unpack', consumer);
+            error('Should have failed for %s', mode{1});
+        catch err
+            assert(strcmp(err.identifier, 'msgpack:unpack_error'), 'Wrong error for %s', mode{1});
+        end
+        assert(system(sprintf('%s %s 3', exe, name)) == 0, 'Producer failed');
+        objs = msgpack('ring_unpack', consumer);
+        assert(numel(objs) == 3 && objs{3}{1} == 3, 'Ring stalled after %s', mode{1});
+    end
+    delete(exe);
+end
+
+%% close and unlink
+msgpack('ring_close', producer);
+msgpack('ring_close', consumer);
+msgpack('ring_unlink', name);
+try
+    msgpack('ring_unpack', consumer);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:ring_bad_handle'), 'Wrong error');
+end
+
+%% all passed
+disp('All tests passed.');
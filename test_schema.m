@@ -0,0 +1,59 @@
+msgpack('reset_flags');
+msgpack('clear_schemas');
+
+%% typed scalars and rows are stable even for all-integer or nil data
+proto = struct('t', 0, 'x', single([]), 'id', uint32(0), 'name', '', 'any', {{}});
+id = msgpack('register_schema', proto);
+msg = struct('t', 3, 'x', {{1, 2, 3}}, 'id', 7, 'name', 'abc', 'any', {{1, 'a'}});
+unpacked = msgpack('unpack_schema', msgpack('pack', msg), id);
+assert(isa(unpacked.t, 'double') && unpacked.t == 3, 'Wrong t');
+assert(isa(unpacked.x, 'single') && isequal(unpacked.x, single([1 2 3])), 'Wrong x');
+assert(isa(unpacked.id, 'uint32') && unpacked.id == 7, 'Wrong id');
+assert(strcmp(unpacked.name, 'abc'), 'Wrong name');
+assert(iscell(unpacked.any), 'Wrong any');
+
+%% struct arrays
+proto = struct('n', 0, 'pos', struct('x', {0, 0}, 'y', {0, 0}));
+id = msgpack('register_schema', proto);
+msg = struct('n', 3);
+msg.pos = {struct('x', 1, 'y', 2), struct('x', 3, 'y', 4), struct('x', 5, 'y', 6)};
+unpacked = msgpack('unpack_schema', msgpack('pack', msg), id);
+assert(isequal(size(unpacked.pos), [1 3]), 'Wrong struct array size');
+assert(unpacked.pos(3).y == 6, 'Wrong struct array value');
+
+%% mismatches are errors
+id = msgpack('register_schema', struct('a', int8(0), 'b', 0));
+bad = {struct('a', 300, 'b', 1), struct('a', 1, 'b', 'x'), struct('a', 1, 'c', 1)};
+for i = 1:numel(bad)
+    try
+        msgpack('unpack_schema', msgpack('pack', bad{i}), id);
+        error('Should have failed for case %d', i);
+    catch err
+        assert(strcmp(err.identifier, 'msgpack:schema_mismatch'), 'Wrong error for case %d', i);
+    end
+end
+
+%% a repeated key is an error
+% {a: 1, b: 2, a: 3}
+dup = uint8([131, 161, uint8('a'), 1, 161, uint8('b'), 2, 161, uint8('a'), 3]);
+try
+    msgpack('unpack_schema', dup, id);
+    error('Should have failed for a duplicate key');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:schema_mismatch'), 'Wrong error for a duplicate key');
+    assert(~isempty(strfind(err.message, 'duplicate key')), 'Wrong message for a duplicate key');
+end
+
+%% a mismatch leaves nothing behind for the next message
+for i = 1:100
+    try
+        msgpack('unpack_schema', msgpack('pack', bad{1}), id);
+    catch
+    end
+end
+unpacked = msgpack('unpack_schema', msgpack('pack', struct('a', 1, 'b', 2)), id);
+assert(isa(unpacked.a, 'int8') && unpacked.a == 1 && unpacked.b == 2, 'Wrong unpack after errors');
+
+%% all passed
+msgpack('clear_schemas');
+disp('All tests passed.');
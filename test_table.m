@@ -0,0 +1,56 @@
+msgpack('reset_flags');
+
+%% string array
+expected = ["alpha", "", "γδ", "x"];
+unpacked = msgpack('unpack', msgpack('pack', expected));
+assert(isstring(unpacked), 'Should be string');
+assert(isequal(expected, unpacked), 'String mismatch');
+
+%% scalar string packs like char
+assert(isequal(msgpack('pack', "abc"), msgpack('pack', 'abc')), 'Scalar string should be str');
+
+%% categorical
+expected = categorical({'lo', 'hi', 'lo', 'mid'});
+expected(3) = missing;
+unpacked = msgpack('unpack', msgpack('pack', expected));
+assert(iscategorical(unpacked), 'Should be categorical');
+assert(isequal(categories(expected), categories(unpacked)), 'Category mismatch');
+assert(isequal(isundefined(expected), isundefined(unpacked)), 'Undefined mismatch');
+assert(all(expected(~isundefined(expected)) == unpacked(~isundefined(unpacked))), 'Code mismatch');
+
+%% datetime
+expected = datetime(2020, 1, 1:3, 12, 30, 15.25);
+unpacked = msgpack('unpack', msgpack('pack', expected));
+assert(isdatetime(unpacked), 'Should be datetime');
+assert(isequal(expected, unpacked), 'Datetime mismatch');
+
+%% table round trip
+t = table((1:4)', int32([5; 6; 7; 8]), ["a"; "b"; "c"; "d"], categorical({'x'; 'y'; 'x'; 'y'}), ...
+          'VariableNames', {'t', 'n', 'label', 'group'});
+unpacked = msgpack('unpack_table', msgpack('pack', t));
+assert(istable(unpacked), 'Should be table');
+assert(isequal(t.Properties.VariableNames, unpacked.Properties.VariableNames), 'Names mismatch');
+assert(isequal(t.t, unpacked.t), 'Double column mismatch');
+assert(isequal(t.n, unpacked.n), 'Int column mismatch');
+assert(isequal(t.label, unpacked.label), 'String column mismatch');
+assert(isequal(t.group, unpacked.group), 'Categorical column mismatch');
+
+%% multi-column variables keep their size
+t = table([1 2; 3 4; 5 6], ['ab'; 'cd'; 'ef'], {'a', 'b'; 'c', 'd'; 'e', 'f'}, ...
+          'VariableNames', {'xy', 'code', 'tags'});
+unpacked = msgpack('unpack_table', msgpack('pack', t));
+assert(isequal(size(unpacked), [3 3]), 'Should be 3x3 table');
+assert(isequal(t.xy, unpacked.xy), 'Numeric N-by-2 mismatch');
+assert(isequal(t.code, unpacked.code), 'Char N-by-2 mismatch');
+assert(isequal(t.tags, unpacked.tags), 'Cellstr N-by-2 mismatch');
+
+%% one-row table
+t = table(7, "one", {'x'}, 'VariableNames', {'n', 'label', 'tag'});
+unpacked = msgpack('unpack_table', msgpack('pack', t));
+assert(isequal(size(unpacked), [1 3]), 'Should be 1x3 table');
+assert(isequal(t.n, unpacked.n), 'Numeric column mismatch');
+assert(isstring(unpacked.label) && isequal(t.label, unpacked.label), 'String column mismatch');
+assert(iscell(unpacked.tag) && isequal(t.tag, unpacked.tag), 'Cell column mismatch');
+
+%% all passed
+disp('All tests passed.');
@@ -0,0 +1,38 @@
+msgpack('reset_flags');
+
+%% whole buffer
+buf = msgpack('pack', 1, 'two', [3 4]);
+objs = msgpack('unpacker', buf);
+assert(iscell(objs) && numel(objs) == 3, 'Wrong number of objects');
+assert(strcmp(objs{2}, 'two'), 'Wrong object');
+
+%% bounded batches with resume offset
+buf = msgpack('pack', 1, 2, 3, 4, 5);
+[objs, offset] = msgpack('unpacker', buf, 0, 2);
+assert(isequal(objs, {1, 2}) && offset == 18, 'Wrong first batch');
+[objs, offset] = msgpack('unpacker', buf, offset, 2);
+assert(isequal(objs, {3, 4}) && offset == 36, 'Wrong second batch');
+[objs, offset] = msgpack('unpacker', buf, offset, 2);
+assert(isequal(objs, {5}) && offset == numel(buf), 'Wrong last batch');
+
+%% byte budget stops after the message that crosses it
+[objs, offset] = msgpack('unpacker', buf, 0, Inf, 10);
+assert(numel(objs) == 2 && offset == 18, 'Wrong byte-bounded batch');
+
+%% incomplete trailing message is left for later
+[objs, offset] = msgpack('unpacker', buf(1:end-3));
+assert(numel(objs) == 4 && offset == 36, 'Partial message should not be consumed');
+
+%% bad size arguments
+for bad = {1e20, NaN, -Inf, -1, 1.5}
+    try
+        msgpack('unpacker', buf, 0, bad{1});
+        error('Should have failed');
+    catch err
+        assert(strcmp(err.identifier, 'msgpack:bad_argument'), ...
+               'Wrong error for max_count %g', bad{1});
+    end
+end
+
+%% all passed
+disp('All tests passed.');
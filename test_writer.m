@@ -0,0 +1,43 @@
+msgpack('reset_flags');
+path = [tempname, '.msgpack'];
+
+%% append many messages through small buffers and read them back
+h = msgpack('writer_open', path, 64, 2);
+for i = 1:500
+    msgpack('writer_append', h, i, sprintf('msg %d', i));
+end
+msgpack('writer_flush', h);
+msgpack('writer_append', h, 'last');
+msgpack('writer_close', h);
+
+fid = fopen(path, 'r');
+buf = fread(fid, Inf, '*uint8')';
+fclose(fid);
+delete(path);
+objs = msgpack('unpacker', buf);
+assert(numel(objs) == 1001, 'Wrong number of messages');
+assert(objs{999} == 500 && strcmp(objs{1000}, 'msg 500'), 'Wrong message');
+assert(strcmp(objs{end}, 'last'), 'Wrong last message');
+
+%% closed handles are rejected
+try
+    msgpack('writer_append', h, 1);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:writer_bad_handle'), 'Wrong error');
+end
+
+%% handles are not reused, so a stale handle can't write to a later writer
+h2 = msgpack('writer_open', path);
+assert(h2 ~= h, 'Closed handle reused');
+try
+    msgpack('writer_append', h, 1);
+    error('Should have failed');
+catch err
+    assert(strcmp(err.identifier, 'msgpack:writer_bad_handle'), 'Wrong error for stale handle');
+end
+msgpack('writer_close', h2);
+delete(path);
+
+%% all passed
+disp('All tests passed.');